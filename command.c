@@ -23,6 +23,8 @@
  * Purpose: User interface.
  */
 
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "global.h"
 #include "error.h"
 #include "input.h"
@@ -38,10 +40,13 @@ static int argc, argi;
 static char **argv;
 static boolean first;
 
-static int cmdf;
+static command_source comstdin;
+static command_source *clients[MAX_COMMAND_CLIENTS];
+static int clientsnum;
+static int ctrlf;       /* listening control socket, -1 if none */
+static char *ctrlname;  /* its path, to be removed when finished */
 
-static byte combuf[MAX_DATA_COMB];
-static int combln, comlln;
+static int comlln;
 static char *comarg;
 
 static char *lastfile;  /* Hold last filename used */
@@ -99,6 +104,9 @@ static command_list coms[] = {
     "set repeatition for <file'> to <num>, infinite=0", ""},
  {C_FROP,7,'R',"reopen",
     "...    open the next file with new handle even if yet open", ""},
+ {C_PASS,12,-1, "passthrough","[0|1]", NULL},
+ {0,     18,-1, NULL,
+    "keep TS packets of the next --ts streams, restamp PCR=1", NULL},
  {C_TSSI,3, -1, "si",
     "<file'> [<low> <high>]", NULL},
  {0,     18,-1, NULL,
@@ -132,6 +140,8 @@ static command_list coms[] = {
     "<msec>", ""},
  {0,     18,-1, NULL,
     "set output buffer trigger timing, initial=250", ""},
+ {C_BRST,6, -1, "burst",
+    "<bytes> set maximum output write burst size, initial=8272", ""},
  {C_CONF,7 ,'C',"config",
     "0..2   show current stream configuration (off=0, on=1, more=2)", ""},
  {C_STAT,11,'S',"statistics",
@@ -145,40 +155,65 @@ static command_list coms[] = {
  {C_CPID,17,-1, "conservativepids", "[0|1]", NULL},
  {0,     18,-1, NULL,
     "be conservative in pid assignment", NULL},
+ {C_MUXR,8, -1, "muxrate",
+    "<bps>   set constant output mux rate, variable=0, initial=0", NULL},
+ {C_EPOL,14,-1, "epoll",
+    "use epoll based dispatching (command line only)", ""},
+ {C_THRD,14,-1, "threads",
+    "split TS inputs concurrently (command line only)", ""},
+ {C_HUGE,14,-1, "hugepages",
+    "take buffer memory from huge pages (command line only)", ""},
+ {C_CTRL,8, -1, "control", "<path>", ""},
+ {0,     18,-1, NULL,
+    "accept commands on a unix domain socket (command line only)", ""},
+ {C_SINK,5, -1, "sink",  "<file> [<policy>]", ""},
+ {0,     18,-1, NULL,
+    "send output to <file>, stdout='-' (command line only)", ""},
+ {0,     18,-1, NULL,
+    "if it lags behind: block (initial), drop, disconnect", ""},
+ {C_M2TS,14,-1, "m2ts",
+    "write files as M2TS with time stamps (command line only)", NULL},
+ {C_OUDP,4, -1, "udp",   "<host>:<port> [<ttl>] [<policy>]", NULL},
+ {0,     18,-1, NULL,
+    "send output as UDP datagrams (command line only)", NULL},
+ {C_ORTP,4, -1, "rtp",   "<host>:<port> [<ttl>] [<policy>]", NULL},
+ {0,     18,-1, NULL,
+    "send output as RTP datagrams (command line only)", NULL},
  {0,     0,  0, NULL,    NULL, NULL}
 };
 
-/* Pop m characters from command input buffer by moving
+/* Pop m characters from a command input buffer by moving
  * the rest to the left.
- * Precondition: 0<=m<=cmbln
+ * Precondition: 0<=m<=c->length
  */
-static void moveleft (int m)
+static void moveleft (command_source *c,
+    int m)
 {
-  combln -= m;
-  memmove (&combuf[0], &combuf[m], combln);
+  c->length -= m;
+  memmove (&c->buf[0], &c->buf[m], c->length);
 }
 
 /* Determine whether there is a complete command line
  * available. If so, split into single words.
- * Precondition: combln>=0
+ * Precondition: c->length>=0
  * Postcondition: argc==WordCount and argi==1 and comarg^==Word[0]
  *                and comlln==LineLength
  * Return: TRUE, if line complete, FALSE otherwise.
  */ 
-static boolean line_complete (void)
+static boolean line_complete (command_source *c)
 {
   int i;
   i = 0;
-  while (i < combln) {
-    if (combuf[i] == '\n') {
+  while (i < c->length) {
+    if (c->buf[i] == '\n') {
       argc = 1;
       comlln = i;
       while (i >= 0) {
-        if (combuf[i] <= ' ') {
-          combuf[i] = 0;
+        if (c->buf[i] <= ' ') {
+          c->buf[i] = 0;
           argi = argc;
         } else {
-          comarg = &combuf[i];
+          comarg = &c->buf[i];
           argc = argi+1;
         }
         i -= 1;
@@ -465,11 +500,84 @@ static long com_number (char *t,
   }
 }
 
+/* Parse a token word to see if it names a sink policy.
+ * Return: policy if parsed, -1 otherwise.
+ */
+static int com_policy (char *t)
+{
+  if (t == NULL) {
+    return (-1);
+  } else if (!strcmp (t,"block")) {
+    return (sp_block);
+  } else if (!strcmp (t,"drop")) {
+    return (sp_drop);
+  } else if (!strcmp (t,"disconnect")) {
+    return (sp_disconnect);
+  }
+  return (-1);
+}
+
 static void command_toofew (void)
 {
   fprintf (stderr, "Too few or bad arguments.\n");
 }
 
+/* Open the control socket, to accept command clients on.
+ * The socket is accessible to the owner only. A socket left over at the
+ * given path is replaced, unless another process is listening on it.
+ * Return: TRUE, if listening, FALSE otherwise.
+ */
+static boolean command_listen (char *name)
+{
+  struct sockaddr_un a;
+  struct stat st;
+  int s, r;
+  mode_t m;
+  if (ctrlf >= 0) {
+    warn (LWAR,"Control again",ECOM,4,1,ctrlf);
+    return (FALSE);
+  }
+  if (strlen (name) >= sizeof (a.sun_path)) {
+    warn (LERR,"Control name",ECOM,4,2,strlen (name));
+    return (FALSE);
+  }
+  memset (&a,0,sizeof (a));
+  a.sun_family = AF_UNIX;
+  strcpy (a.sun_path,name);
+  if ((s = socket (AF_UNIX,SOCK_STREAM,0)) < 0) {
+    warn (LERR,"Control socket",ECOM,4,3,errno);
+    return (FALSE);
+  }
+  if ((stat (name,&st) == 0)
+   && (S_ISSOCK (st.st_mode))) {
+    if (connect (s,(struct sockaddr *)&a,sizeof (a)) == 0) {
+      warn (LERR,"Control in use",ECOM,4,5,0);
+      close (s);
+      return (FALSE);
+    }
+    close (s);
+    unlink (name);
+    if ((s = socket (AF_UNIX,SOCK_STREAM,0)) < 0) {
+      warn (LERR,"Control socket",ECOM,4,3,errno);
+      return (FALSE);
+    }
+  }
+  m = umask (0077);
+  r = bind (s,(struct sockaddr *)&a,sizeof (a));
+  umask (m);
+  if ((r < 0)
+   || (listen (s,MAX_COMMAND_CLIENTS) < 0)
+   || ((r = fcntl (s,F_GETFL)) < 0)
+   || (fcntl (s,F_SETFL,r | O_NONBLOCK) < 0)) {
+    warn (LERR,"Control socket",ECOM,4,4,errno);
+    close (s);
+    return (FALSE);
+  }
+  ctrlf = s;
+  ctrlname = name;
+  return (TRUE);
+}
+
 /* Process one line of command words.
  * Precondition: argc==WordCount and argi==1 and comarg^==Word[0]
  * Return: TRUE, if processed ok, FALSE otherwise.
@@ -482,8 +590,10 @@ static boolean command (void)
   char *t;
   boolean r;
   boolean frop;
+  byte pass;
   r = TRUE;
   frop = FALSE;
+  pass = PASS_NONE;
   t = available_token ();
   while (r && (t != NULL)) {
     next_token ();
@@ -607,6 +717,10 @@ static boolean command (void)
           if ((!fileagain (fn))
            && (sprg < 0)) {
             f = openfile (fn,rn,ct_transport,TRUE,0,frop);
+            if ((f != NULL)
+             && (f->content == ct_transport)) {
+              f->u.ts.autopass = pass;
+            }
           } else {
             if (sprg >= 0) {
               f = openfile (fn,rn,ct_transport,FALSE,0,frop);
@@ -656,7 +770,9 @@ static boolean command (void)
                     a->tprg = tprg;
                     a->ssid = ssid;
                     a->tsid = tsid;
+                    a->pass = pass;
                     f->u.ts.tsauto = a;
+                    ts_file_pidchanged (f);
                   }
                 }
               }
@@ -670,6 +786,7 @@ static boolean command (void)
           r = FALSE;
         }
         frop = FALSE;
+        pass = PASS_NONE;
         break;
       case C_CLOS:
         fn = available_token ();
@@ -833,6 +950,16 @@ static boolean command (void)
       case C_FROP:
         frop = TRUE;
         break;
+      case C_PASS:
+        {
+          int restamp;
+          restamp = com_number (available_token (),0,1);
+          pass = (restamp == 1) ? PASS_RESTAMP : PASS_PCR;
+          if (restamp >= 0) {
+            next_token ();
+          }
+        }
+        break;
       case C_REPT:
         fn = available_token ();
         rn = com_number (fn,0,-1);
@@ -916,6 +1043,76 @@ static boolean command (void)
           }
         }
         break;
+      case C_OUDP:
+      case C_ORTP:
+        fn = available_token ();
+        if (fn != NULL) {
+          int ttl, policy;
+          next_token ();
+          ttl = com_number (available_token (),1,255);
+          if (ttl >= 0) {
+            next_token ();
+          }
+          policy = com_policy (available_token ());
+          if (policy >= 0) {
+            next_token ();
+          } else {
+            policy = sp_block;
+          }
+          if (!first) {
+            warn (LWAR,"Startup only",ECOM,1,14,0);
+          } else if (!output_setnet (fn,ttl,(token_code (t) == C_ORTP),
+                policy)) {
+            warn (LERR,"No network output",ECOM,1,15,0);
+            r = FALSE;
+          }
+        } else {
+          command_toofew ();
+          r = FALSE;
+        }
+        break;
+      case C_SINK:
+        fn = available_token ();
+        if (fn != NULL) {
+          int policy;
+          next_token ();
+          policy = com_policy (available_token ());
+          if (policy >= 0) {
+            next_token ();
+          } else {
+            policy = sp_block;
+          }
+          if (!first) {
+            warn (LWAR,"Startup only",ECOM,1,16,0);
+          } else if (!output_addsink (fn,policy)) {
+            warn (LERR,"No sink",ECOM,1,17,0);
+            r = FALSE;
+          }
+        } else {
+          command_toofew ();
+          r = FALSE;
+        }
+        break;
+      case C_M2TS:
+        if (first) {
+          output_setm2ts ();
+        } else {
+          warn (LWAR,"Startup only",ECOM,1,18,0);
+        }
+        break;
+      case C_BRST:
+        {
+          int size;
+          size = com_number (available_token (),1,MAX_DATA_OUTB);
+          if (size >= 0) {
+            output_setburst (size);
+            next_token ();
+          } else {
+            command_toofew ();
+            r = FALSE;
+          }
+        }
+        break;
       case C_TSID:
         {
           int tsid;
@@ -958,6 +1155,7 @@ static boolean command (void)
               } else {
                 releasechain (tssi_descr,f->u.ts.tssi);
                 f->u.ts.tssi = NULL;
+                ts_file_pidchanged (f);
               }
             } else {
               warn (LWAR,"File must be TS",ECOM,1,8,0);
@@ -1182,6 +1380,58 @@ static boolean command (void)
           }
         }
         break;
+      case C_EPOL:
+        if (first) {
+          if (!dispatch_setepoll ()) {
+            warn (LWAR,"No epoll",ECOM,1,10,0);
+          }
+        } else {
+          warn (LWAR,"Startup only",ECOM,1,11,0);
+        }
+        break;
+      case C_THRD:
+        if (first) {
+          if (!input_setthreads ()) {
+            warn (LWAR,"No threads",ECOM,1,12,0);
+          }
+        } else {
+          warn (LWAR,"Startup only",ECOM,1,13,0);
+        }
+        break;
+      case C_HUGE:
+        if (first) {
+          pool_hugepages = TRUE;
+        } else {
+          warn (LWAR,"Startup only",ECOM,1,19,0);
+        }
+        break;
+      case C_CTRL:
+        fn = available_token ();
+        if (fn != NULL) {
+          next_token ();
+          if (!first) {
+            warn (LWAR,"Startup only",ECOM,1,20,0);
+          } else if (!command_listen (fn)) {
+            r = FALSE;
+          }
+        } else {
+          command_toofew ();
+          r = FALSE;
+        }
+        break;
+      case C_MUXR:
+        {
+          long rate;
+          rate = com_number (available_token (),0,0x7FFFFFFFL);
+          if (rate >= 0) {
+            splice_setmuxrate (rate);
+            next_token ();
+          } else {
+            command_toofew ();
+            r = FALSE;
+          }
+        }
+        break;
       default:
         fprintf (stderr, "Unknown command: %s\n", t);
         if (first) {
@@ -1204,52 +1454,283 @@ boolean command_init (int cargc,
   argi = 1;
   argc = cargc;
   argv = cargv;
-  combln = 0;
+  memset (&comstdin,0,sizeof (comstdin));
+  comstdin.handle = -1;
+  clientsnum = 0;
+  ctrlf = -1;
+  ctrlname = NULL;
   lastfile = NULL;
   first = TRUE;
   if (!command ()) {
     return (FALSE);
   }
   first = FALSE;
-  cmdf = STDIN_FILENO;
-  return (cmdf >= 0);
+  comstdin.handle = STDIN_FILENO;
+  return (comstdin.handle >= 0);
+}
+
+/* Close the control socket and disconnect all its clients.
+ */
+void command_finish (void)
+{
+  while (--clientsnum >= 0) {
+    if (clients[clientsnum]->handle >= 0) {
+      dispatch_forget (clients[clientsnum]->handle);
+      close (clients[clientsnum]->handle);
+    }
+    free (clients[clientsnum]);
+  }
+  clientsnum = 0;
+  if (ctrlf >= 0) {
+    dispatch_forget (ctrlf);
+    close (ctrlf);
+    unlink (ctrlname);
+    ctrlf = -1;
+  }
+}
+
+/* Determine the number of handles used for commands besides stdin.
+ * Return: number of handles.
+ */
+int command_handlecount (void)
+{
+  return (clientsnum + ((ctrlf >= 0) ? 1 : 0));
 }
 
 /* Determine whether command input can be processed.
- * Set the poll-struct accordingly.
+ * Set the poll-struct accordingly, stdin first, then the control socket
+ * as long as another client may connect, then the clients.
  * Return: TRUE, if command input is expected, FALSE otherwise.
  */
 boolean command_expected (unsigned int *nfds,
     struct pollfd *ufds)
 {
-  if (cmdf >= 0) {
-    ufds->fd = cmdf;
+  int i;
+  unsigned int n = *nfds;
+  if (comstdin.handle >= 0) {
+    ufds->fd = comstdin.handle;
+    ufds->events = POLLIN;
+    ufds += 1;
+    *nfds += 1;
+  }
+  if ((ctrlf >= 0)
+   && (clientsnum < MAX_COMMAND_CLIENTS)) {
+    ufds->fd = ctrlf;
     ufds->events = POLLIN;
+    ufds += 1;
     *nfds += 1;
   }
-  return (cmdf >= 0);
+  i = 0;
+  while (i < clientsnum) {
+    ufds->fd = clients[i]->handle;
+    ufds->events = POLLIN;
+    ufds += 1;
+    *nfds += 1;
+    i += 1;
+  }
+  return (*nfds > n);
 }
 
-/* Read command input and process it.
+/* Disconnect a client of the control socket. Its descriptor is
+ * released later on by command_process.
  */
-void command_process (boolean readable)
+static void command_disconnect (command_source *c)
 {
-  int i;
-  if (combln >= MAX_DATA_COMB-HIGHWATER_COM) {
-    warn (LWAR,"Too long",ECOM,2,1,combln);
-    moveleft (HIGHWATER_COM);
+  warn (LIMP,"Disconnect",ECOM,5,1,c->handle);
+  dispatch_forget (c->handle);
+  close (c->handle);
+  c->handle = -1;
+}
+
+/* Send the acknowledgements collected for a client of the control socket.
+ * A client that does not take its acknowledgements is disconnected.
+ */
+static void command_flush (command_source *c)
+{
+  if ((c->replied > 0)
+   && (c->handle >= 0)) {
+    if (send (c->handle,&c->reply[0],c->replied,MSG_DONTWAIT | MSG_NOSIGNAL)
+        != c->replied) {
+      warn (LWAR,"Reply fail",ECOM,5,2,errno);
+      command_disconnect (c);
+    }
+    c->replied = 0;
+  }
+}
+
+/* Acknowledge a command line to a client of the control socket,
+ * with the status followed by the number of the line, e.g. "ok 3".
+ */
+static void command_reply (command_source *c,
+    char *status)
+{
+  if (c->client) {
+    if (c->replied > MAX_DATA_COMR - 32) {
+      command_flush (c);
+    }
+    c->replied += snprintf (&c->reply[c->replied],MAX_DATA_COMR - c->replied,
+        "%s %d\n",status,c->lines);
   }
+}
+
+/* Process all complete lines held in a command input buffer.
+ * A line that does not fit into the buffer is skipped as a whole,
+ * and acknowledged with "overlong".
+ * Return: TRUE, if any command was processed, FALSE otherwise
+ */
+static boolean command_lines (command_source *c)
+{
+  boolean r = FALSE;
+  while ((c->handle >= 0)
+      && line_complete (c)) {
+    c->lines += 1;
+    if (c->overlong) {
+      c->overlong = FALSE;
+      command_reply (c,"overlong");
+    } else {
+      command_reply (c,command () ? "ok" : "error");
+      r = TRUE;
+    }
+    moveleft (c,comlln+1);
+  }
+  command_flush (c);
+  if (c->length >= MAX_DATA_COMB) {
+    warn (LWAR,"Too long",ECOM,2,1,c->length);
+    c->length = 0;
+    c->overlong = TRUE;
+  }
+  return (r);
+}
+
+/* Stop polling stdin, as its end is reached, or it hung up.
+ * It is left open, so that its handle is not reused.
+ */
+static void command_endstdin (command_source *c)
+{
+  warn (LIMP,"End of commands",ECOM,5,6,c->handle);
+  dispatch_forget (c->handle);
+  c->handle = -1;
+}
+
+/* Read command input from one source and process it.
+ * A client is read until drained, so that a batch of commands
+ * sent at once is applied within the same dispatch iteration.
+ * Stdin is no longer polled after its end.
+ * Return: TRUE, if any command was processed, FALSE otherwise
+ */
+static boolean command_read (command_source *c,
+    boolean readable)
+{
+  int i, n;
+  boolean r = FALSE;
   if (readable) {
-    i = read (cmdf,&combuf[combln],MAX_DATA_COMB-combln);
+    do {
+      n = MAX_DATA_COMB - c->length;
+      i = read (c->handle,&c->buf[c->length],n);
+      if (i > 0) {
+        c->length += i;
+        if (command_lines (c)) {
+          r = TRUE;
+        }
+      }
+    } while (c->client && (i > 0) && (c->handle >= 0));
+    if (c->client) {
+      if ((i < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+        dispatch_drained (c->handle,POLLIN);
+      } else if (c->handle >= 0) {
+        command_disconnect (c);
+      }
+    } else if (i == 0) {
+      command_endstdin (c);
+    } else if (i < n) {
+      dispatch_drained (c->handle,POLLIN);
+    }
+  } else if (c->client) {
+    command_disconnect (c);
   } else {
-    i = 0;
+    command_endstdin (c);
+  }
+  return (r);
+}
+
+/* Accept pending clients on the control socket, as many as allowed.
+ */
+static void command_accept (void)
+{
+  command_source *c;
+  int h, r;
+  while (clientsnum < MAX_COMMAND_CLIENTS) {
+    if ((h = accept (ctrlf,NULL,NULL)) < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        dispatch_drained (ctrlf,POLLIN);
+      } else {
+        warn (LWAR,"Accept fail",ECOM,5,3,errno);
+      }
+      return;
+    }
+    if (((r = fcntl (h,F_GETFL)) < 0)
+     || (fcntl (h,F_SETFL,r | O_NONBLOCK) < 0)
+     || ((c = malloc (sizeof (command_source))) == NULL)) {
+      warn (LWAR,"Accept fail",ECOM,5,4,errno);
+      close (h);
+      return;
+    }
+    warn (LIMP,"Accept",ECOM,5,5,h);
+    c->handle = h;
+    c->length = 0;
+    c->lines = 0;
+    c->client = TRUE;
+    c->overlong = FALSE;
+    c->replied = 0;
+    clients[clientsnum++] = c;
   }
-  if (i > 0) {
-    combln += i;
-    while (line_complete ()) {
-      command ();
-      moveleft (comlln+1);
+}
+
+/* Read command input from all sources that are ready, and process it.
+ * All commands available are processed here, so that they take effect
+ * together, before any more data is spliced.
+ * Precondition: ufds as set by command_expected, with revents
+ * Return: TRUE, if any command was processed, FALSE otherwise
+ */
+boolean command_process (struct pollfd *ufds,
+    unsigned int nfds)
+{
+  int i;
+  boolean r = FALSE;
+  boolean pending = FALSE;
+  while (nfds > 0) {
+    if (ufds->revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (ufds->fd == comstdin.handle) {
+        if (command_read (&comstdin,ufds->revents & POLLIN)) {
+          r = TRUE;
+        }
+      } else if (ufds->fd == ctrlf) {
+        pending = TRUE;
+      } else {
+        i = clientsnum;
+        while (--i >= 0) {
+          if (clients[i]->handle == ufds->fd) {
+            if (command_read (clients[i],ufds->revents & POLLIN)) {
+              r = TRUE;
+            }
+            break;
+          }
+        }
+      }
+    }
+    ufds += 1;
+    nfds -= 1;
+  }
+  i = clientsnum;
+  while (--i >= 0) {
+    if (clients[i]->handle < 0) {
+      free (clients[i]);
+      clients[i] = clients[--clientsnum];
     }
   }
+  if (pending) {
+    command_accept ();
+  }
+  return (r);
 }
 
@@ -50,7 +50,18 @@ enum {
   C_STAT,
   C_NETW,
   C_BSCR,
-  C_CPID
+  C_CPID,
+  C_MUXR,
+  C_EPOL,
+  C_THRD,
+  C_BRST,
+  C_OUDP,
+  C_ORTP,
+  C_SINK,
+  C_PASS,
+  C_M2TS,
+  C_HUGE,
+  C_CTRL
 };
 
 typedef struct {
@@ -71,9 +82,26 @@ typedef struct filerefer_list {
   char *filename;
 } filerefer_list;
 
+/* Source of command lines during operation, i.e. stdin
+ * or a client connected to the control socket:
+ */
+typedef struct {
+  int handle;       /* -1, if closed */
+  int length;       /* number of bytes held in buf */
+  int lines;        /* number of lines taken, to tag acknowledgements */
+  boolean client;   /* acknowledge each line, FALSE for stdin */
+  boolean overlong; /* skip up to the end of an overlong line */
+  int replied;      /* number of bytes held in reply */
+  byte buf[MAX_DATA_COMB];
+  char reply[MAX_DATA_COMR];
+} command_source;
+
 boolean command_init (int cargc,
     char **cargv);
+void command_finish (void);
+int command_handlecount (void);
 boolean command_expected (unsigned int *nfds,
     struct pollfd *ufds);
-void command_process (boolean readable);
+boolean command_process (struct pollfd *ufds,
+    unsigned int nfds);
 
@@ -21,9 +21,82 @@
 #include <stdint.h>
 #include "crc32.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32_PCLMUL
+#include <immintrin.h>
+#endif
+
 uint32_t crc_32_table[256];
 
-// generate the tables of CRC-32 remainders for all possible bytes
+// crc_32_slice[k][b] is the CRC-32 remainder of byte b followed by k zeros
+static uint32_t crc_32_slice[8][256];
+
+#ifdef CRC32_PCLMUL
+// x^n mod P for folding 128 bit blocks and for the final reduction
+static uint64_t crc_32_k192, crc_32_k128, crc_32_k96, crc_32_k64;
+#endif
+
+static uint32_t crc32_bytewise(uint32_t crc, const unsigned char *d, int n);
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *d, int n);
+
+// the engine in use, selected by gen_crc32_table
+static uint32_t (*crc32_engine)(uint32_t crc, const unsigned char *d, int n)
+    = crc32_bytewise;
+
+#ifdef CRC32_PCLMUL
+// calculate x^n mod P
+static uint32_t crc32_xpow(int n)
+{
+  register uint32_t c;
+  c = 1;
+  while (--n >= 0) {
+    c = (c << 1) ^ ((c & (1UL<<31)) ? POLYNOMIAL_32_MSBF : 0);
+  }
+  return c;
+}
+
+// fold 16 bytes per step with carry-less multiplication, then reduce the
+// 128 bit remainder and let slicing-by-8 do the tail.
+// the blocks are byte reversed, so that bit i holds the coefficient of x^i.
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *d, int n)
+{
+  __m128i rev, k, x, b, h;
+  uint64_t t;
+  int i;
+  if (n < 32)
+    return crc32_slice8(crc, d, n);
+  rev = _mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  k = _mm_set_epi64x(crc_32_k192, crc_32_k128);
+  x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)d), rev);
+  x = _mm_xor_si128(x, _mm_set_epi32(crc, 0, 0, 0));
+  d += 16;
+  n -= 16;
+  while (n >= 16) {
+    b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)d), rev);
+    h = _mm_clmulepi64_si128(x, k, 0x11);
+    x = _mm_clmulepi64_si128(x, k, 0x00);
+    x = _mm_xor_si128(_mm_xor_si128(x, h), b);
+    d += 16;
+    n -= 16;
+  }
+  // x * x^32 = hi * x^96 + lo * x^32, at most 96 bits remaining
+  h = _mm_clmulepi64_si128(x, _mm_set_epi64x(0, crc_32_k96), 0x01);
+  x = _mm_xor_si128(h, _mm_slli_si128(_mm_move_epi64(x), 4));
+  // hi32 * x^64 + lo64, at most 64 bits remaining
+  h = _mm_clmulepi64_si128(x, _mm_set_epi64x(0, crc_32_k64), 0x01);
+  x = _mm_xor_si128(h, _mm_move_epi64(x));
+  t = _mm_cvtsi128_si64(x);
+  crc = t >> 32;
+  for (i=0; i<4; i++)
+    crc = update_crc_32(crc, 0);
+  crc ^= (uint32_t)t;
+  return crc32_slice8(crc, d, n);
+}
+#endif
+
+// generate the tables of CRC-32 remainders for all possible bytes,
+// and select the fastest engine available on this cpu
 void gen_crc32_table() { 
   register int i,j;  
   register uint32_t crc32;
@@ -33,30 +106,121 @@ void gen_crc32_table() {
       crc32 = (crc32 << 1) ^ ((crc32 & (1<<31)) ? POLYNOMIAL_32_MSBF : 0);
     }
     crc_32_table[i]=crc32; 
+    crc_32_slice[0][i]=crc32;
   }
+  for (j=1; j<8; j++) {
+    for (i=0; i<256; i++) {
+      crc32 = crc_32_slice[j-1][i];
+      crc_32_slice[j][i] = (crc32 << 8) ^ crc_32_table[crc32 >> 24];
+    }
+  }
+  crc32_engine = crc32_slice8;
+#ifdef CRC32_PCLMUL
+  crc_32_k192 = crc32_xpow(192);
+  crc_32_k128 = crc32_xpow(128);
+  crc_32_k96 = crc32_xpow(96);
+  crc_32_k64 = crc32_xpow(64);
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+    crc32_engine = crc32_pclmul;
+#endif
 }
 
 // update the CRC on the data block one byte at a time
-uint32_t update_crc_32_block(uint32_t crc, char *data_block_ptr, int data_block_size)
+static uint32_t crc32_bytewise(uint32_t crc, const unsigned char *d, int n)
 {
   register int i;
-  for (i=data_block_size; i>0; i--)
-    crc=update_crc_32(crc, *data_block_ptr++);
+  for (i=n; i>0; i--)
+    crc=update_crc_32(crc, *d++);
   return crc;
 }
 
+// update the CRC on the data block eight bytes at a time
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *d, int n)
+{
+  register uint32_t a, b;
+  while (n >= 8) {
+    a = crc ^ (((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16)
+             | ((uint32_t)d[2] << 8) | d[3]);
+    b = ((uint32_t)d[4] << 24) | ((uint32_t)d[5] << 16)
+      | ((uint32_t)d[6] << 8) | d[7];
+    crc = crc_32_slice[7][a >> 24] ^ crc_32_slice[6][(a >> 16) & 0xFF]
+        ^ crc_32_slice[5][(a >> 8) & 0xFF] ^ crc_32_slice[4][a & 0xFF]
+        ^ crc_32_slice[3][b >> 24] ^ crc_32_slice[2][(b >> 16) & 0xFF]
+        ^ crc_32_slice[1][(b >> 8) & 0xFF] ^ crc_32_slice[0][b & 0xFF];
+    d += 8;
+    n -= 8;
+  }
+  return crc32_bytewise(crc, d, n);
+}
+
+// update the CRC on the data block with the engine selected
+uint32_t update_crc_32_block(uint32_t crc, char *data_block_ptr, int data_block_size)
+{
+  return crc32_engine(crc, (unsigned char *)data_block_ptr, data_block_size);
+}
+
 void crc32_calc (char *data,
     int size,
     char *crc)
 {
   uint32_t c;
-  c = CRC_INIT_32;
-  while (--size >= 0) {
-    c = update_crc_32 (c,*data++);
-  }
+  c = update_crc_32_block (CRC_INIT_32,data,size);
   crc[3] = c; c >>= 8;
   crc[2] = c; c >>= 8;
   crc[1] = c; c >>= 8;
   crc[0] = c;
 }
 
+#ifdef CRC32_BENCHMARK
+// microbenchmark, comparing the engines:
+//   gcc -O2 -DCRC32_BENCHMARK -o crc32bench crc32.c && ./crc32bench
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static void crc32_bench(const char *name,
+    uint32_t (*engine)(uint32_t, const unsigned char *, int),
+    const unsigned char *buf, int size, uint32_t expect)
+{
+  struct timespec t0, t1;
+  uint32_t c;
+  double sec;
+  long i, loops;
+  loops = (256L << 20) / size;
+  c = 0;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (i=0; i<loops; i++)
+    c ^= engine(CRC_INIT_32, buf, size);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  sec = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("%-9s %5d bytes: %08x %s %8.1f MB/s\n", name, size,
+      engine(CRC_INIT_32, buf, size),
+      engine(CRC_INIT_32, buf, size) == expect ? "ok  " : "FAIL",
+      loops * size / sec / 1e6);
+  if (c == 1)
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+  static const int sizes[] = { 12, 188, 1024, 4096 };
+  unsigned char buf[4096];
+  uint32_t expect;
+  int i, n;
+  gen_crc32_table();
+  srand(13818);
+  for (i=0; i<sizeof(buf); i++)
+    buf[i] = rand();
+  for (n=0; n<sizeof(sizes)/sizeof(sizes[0]); n++) {
+    expect = crc32_bytewise(CRC_INIT_32, buf, sizes[n]);
+    crc32_bench("bytewise", crc32_bytewise, buf, sizes[n], expect);
+    crc32_bench("slice8", crc32_slice8, buf, sizes[n], expect);
+#ifdef CRC32_PCLMUL
+    if (crc32_engine == crc32_pclmul)
+      crc32_bench("pclmul", crc32_pclmul, buf, sizes[n], expect);
+#endif
+  }
+  return 0;
+}
+#endif
@@ -27,6 +27,8 @@
  * output data buffer, and further to stdout) are timing controlled.
  */
 
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include "global.h"
 #include "error.h"
 #include "splice.h"
@@ -39,14 +41,257 @@ boolean fatal_error;
 boolean force_quit;
 boolean busy_work;
 
+/* Readiness of a file handle as known to the epoll engine:
+ */
+typedef struct {
+  boolean registered; /* handle is known to the engine */
+  boolean pollable;   /* FALSE for regular files, which are always ready */
+  short ready;        /* POLL* bits reported, but not yet drained */
+} dispatch_handle;
+
+static int epollfd;
+static int timerfd;
+static boolean timerarmed;
+static dispatch_handle *handles;
+static int handles_num;
+
+#define MAX_EPOLLEV 64 /* events fetched per epoll_wait, more are kept */
+
+static struct pollfd *pollfds;
+static int pollfds_alloc;
+
+static long cnt_wait;
+static long cnt_idle;
+
 boolean dispatch_init (void)
 {
   fatal_error = FALSE;
   force_quit = FALSE;
   busy_work = FALSE;
+  epollfd = -1;
+  timerfd = -1;
+  timerarmed = FALSE;
+  handles = NULL;
+  handles_num = 0;
+  pollfds = NULL;
+  pollfds_alloc = 0;
+  cnt_wait = 0;
+  cnt_idle = 0;
+  return (TRUE);
+}
+
+/* Switch the dispatcher from poll to an epoll based engine. Each file
+ * handle is registered once edge triggered, and its readiness is kept
+ * until the module concerned reports it drained (see dispatch_drained).
+ * Output delays are awaited with a timerfd, instead of a poll timeout.
+ * Return: TRUE if the engine is available, FALSE otherwise
+ */
+boolean dispatch_setepoll (void)
+{
+  struct epoll_event ev;
+  if (epollfd >= 0) {
+    return (TRUE);
+  }
+  if ((epollfd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+    warn (LWAR,"epoll fail",EDIS,2,1,errno);
+    return (FALSE);
+  }
+  if ((timerfd = timerfd_create (CLOCK_MONOTONIC,
+          TFD_NONBLOCK|TFD_CLOEXEC)) < 0) {
+    warn (LWAR,"timerfd fail",EDIS,2,2,errno);
+    close (epollfd);
+    epollfd = -1;
+    return (FALSE);
+  }
+  ev.events = EPOLLIN;
+  ev.data.fd = timerfd;
+  if (epoll_ctl (epollfd,EPOLL_CTL_ADD,timerfd,&ev) != 0) {
+    warn (LWAR,"timerfd fail",EDIS,2,3,errno);
+    close (timerfd);
+    close (epollfd);
+    timerfd = epollfd = -1;
+    return (FALSE);
+  }
   return (TRUE);
 }
 
+/* Find the readiness entry for a file handle, enlarge the table if needed.
+ * Precondition: fd>=0
+ * Return: entry, or NULL if out of memory
+ */
+static dispatch_handle *dispatch_handleof (int fd)
+{
+  if (!table_reserve (&handles,&handles_num,fd + 1,sizeof (*handles))) {
+    warn (LERR,"Alloc fail",EDIS,3,1,fd);
+    return (NULL);
+  }
+  return (&handles[fd]);
+}
+
+/* Forget about a file handle that is to be closed, so that its number
+ * may be reused later on.
+ */
+void dispatch_forget (int fd)
+{
+  if ((fd >= 0)
+   && (fd < handles_num)
+   && (handles[fd].registered)) {
+    if (handles[fd].pollable) {
+      epoll_ctl (epollfd,EPOLL_CTL_DEL,fd,NULL);
+    }
+    memset (&handles[fd],0,sizeof (dispatch_handle));
+  }
+}
+
+/* Note, that a module has read or written as much as the file handle
+ * accepted, i.e. the next edge is to be awaited.
+ * events: POLLIN and/or POLLOUT
+ */
+void dispatch_drained (int fd,
+    short events)
+{
+  if ((fd >= 0)
+   && (fd < handles_num)
+   && (handles[fd].pollable)) {
+    handles[fd].ready &= ~events;
+  }
+}
+
+/* Register a file handle with the epoll engine, if not yet done.
+ * Return: entry, or NULL on failure
+ */
+static dispatch_handle *dispatch_register (int fd)
+{
+  struct epoll_event ev;
+  dispatch_handle *h;
+  if ((h = dispatch_handleof (fd)) != NULL) {
+    if (!h->registered) {
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.fd = fd;
+      if (epoll_ctl (epollfd,EPOLL_CTL_ADD,fd,&ev) == 0) {
+        h->pollable = TRUE;
+        h->ready = 0;
+      } else if (errno == EPERM) {
+        h->pollable = FALSE;
+        h->ready = POLLIN | POLLOUT;
+      } else {
+        warn (LWAR,"epoll_ctl fail",EDIS,3,2,errno);
+        return (NULL);
+      }
+      h->registered = TRUE;
+    }
+  }
+  return (h);
+}
+
+/* Arm the output timer, or disarm it if timeout<=0.
+ */
+static void dispatch_settimer (t_clock timeout)
+{
+  struct itimerspec its;
+  if ((timeout > 0) || timerarmed) {
+    memset (&its,0,sizeof (its));
+    if (timeout > 0) {
+      its.it_value.tv_sec = timeout / CLOCK_HZ;
+      its.it_value.tv_nsec =
+        ((timeout % CLOCK_HZ) * 1000) / (CLOCK_HZ / 1000000);
+    }
+    timerfd_settime (timerfd,0,&its,NULL);
+    timerarmed = (timeout > 0);
+  }
+}
+
+/* Wait for any of the file handles to become ready, or the timeout
+ * to expire, using the epoll engine. Interface as with poll.
+ * Return: number of handles with revents set, -1 on failure
+ */
+static int dispatch_epollwait (struct pollfd *ufds,
+    unsigned int nfds,
+    t_clock timeout)
+{
+  struct epoll_event ev [MAX_EPOLLEV];
+  dispatch_handle *h;
+  unsigned int i;
+  int n, r;
+  r = 0;
+  for (i = 0; i < nfds; i++) {
+    if ((h = dispatch_register (ufds[i].fd)) == NULL) {
+      return (-1);
+    }
+    if (h->ready & (ufds[i].events | POLLHUP | POLLERR)) {
+      r += 1;
+    }
+  }
+  if (r > 0) {
+    timeout = 0;
+  }
+  dispatch_settimer (timeout);
+  n = epoll_wait (epollfd,&ev[0],MAX_EPOLLEV,(timeout == 0) ? 0 : -1);
+  while (--n >= 0) {
+    if (ev[n].data.fd == timerfd) {
+      uint64_t expired;
+      if (read (timerfd,&expired,sizeof (expired)) < 0) {
+        warn (LDEB,"timerfd read",EDIS,3,3,errno);
+      }
+      timerarmed = FALSE;
+    } else if ((h = dispatch_handleof (ev[n].data.fd)) != NULL) {
+      h->ready |=
+        ((ev[n].events & EPOLLIN) ? POLLIN : 0) |
+        ((ev[n].events & EPOLLOUT) ? POLLOUT : 0) |
+        ((ev[n].events & (EPOLLHUP | EPOLLRDHUP)) ? POLLHUP : 0) |
+        ((ev[n].events & EPOLLERR) ? POLLERR : 0);
+    }
+  }
+  r = 0;
+  for (i = 0; i < nfds; i++) {
+    ufds[i].revents =
+      handles[ufds[i].fd].ready & (ufds[i].events | POLLHUP | POLLERR);
+    if (ufds[i].revents) {
+      r += 1;
+    }
+  }
+  return (r);
+}
+
+/* Wait for any of the file handles to become ready, or the timeout
+ * to expire, with the engine selected. poll rounds the timeout up to
+ * full milliseconds, the timerfd of the epoll engine does not.
+ * Return: number of handles with revents set, -1 on failure
+ */
+static int dispatch_wait (struct pollfd *ufds,
+    unsigned int nfds,
+    t_clock timeout)
+{
+  int r;
+  if (epollfd >= 0) {
+    r = dispatch_epollwait (ufds,nfds,timeout);
+  } else {
+    r = poll (ufds,nfds,
+        (timeout > 0) ? clock2msec (timeout + CLOCK_MSEC - 1) : timeout);
+  }
+  cnt_wait += 1;
+  if (r == 0) {
+    cnt_idle += 1;
+  }
+  return (r);
+}
+
+/* Make room in the poll table for the command handles,
+ * and for one handle per output sink and input file in use.
+ * Return: poll table, or NULL if out of memory
+ */
+static struct pollfd *dispatch_pollfds (void)
+{
+  if (!table_reserve (&pollfds,&pollfds_alloc,
+        MAX_POLLFD_FIX + command_handlecount ()
+          + output_sinkcount () + input_filecount (),
+        sizeof (*pollfds))) {
+    fatal_error = TRUE;
+    return (NULL);
+  }
+  return (pollfds);
+}
+
 /* Dispatch work to the modules as needed.
  * Mainly, check a few internal conditions (buffer space,
  * data availability), check the corresponding files with
@@ -62,11 +307,14 @@ void dispatch (void)
 {
   boolean bi, bo, bs;
   stream_descr *st;
-  t_msec tmo;
+  t_clock tmo;
   unsigned int nfds, onfds, infds;
   int pollresult;
-  struct pollfd ufds [MAX_POLLFD];
+  struct pollfd *ufds;
   warn (LDEB,"Dispatch",EDIS,0,0,0);
+  if ((ufds = dispatch_pollfds ()) == NULL) {
+    return;
+  }
   bs = FALSE;
   st = input_available ();
   nfds = 0;
@@ -77,12 +325,15 @@ void dispatch (void)
        || bs
        || (st != NULL)
        || input_expected ()
-       || ((tmo >= 0) && (tmo <= MAX_MSEC_OUTDELAY))
+       || ((tmo >= 0) && (tmo <= msec2clock (MAX_MSEC_OUTDELAY)))
        || busy_work)
       && (!fatal_error)
       && (!force_quit)) {
     warn (LDEB,"Loop",EDIS,0,
       bo | (bs << 1) | (input_expected () << 2) | (st ? 1 << 3 : 0),tmo);
+    if ((ufds = dispatch_pollfds ()) == NULL) {
+      break;
+    }
     infds = nfds;
     bi = input_acceptable (&nfds, &ufds[infds], &tmo, output_acceptable ());
     if ((bs)
@@ -91,7 +342,7 @@ void dispatch (void)
     }
     warn (LDEB,"Poll",EDIS,1,nfds,tmo);
 #ifdef DEBUG_TIMEPOLL
-    ltp->tmo = tmo;
+    ltp->tmo = clock2msec (tmo);
     if (ltp->usec != 0) {
       struct timeval tv;
       gettimeofday (&tv,NULL);
@@ -110,7 +361,7 @@ void dispatch (void)
     ltp->nfdsrevent =
 #endif
     pollresult =
-      poll (&ufds[0], nfds, ((!timed_io) && (tmo > 0)) ? 0 : tmo);
+      dispatch_wait (&ufds[0], nfds, ((!timed_io) && (tmo > 0)) ? 0 : tmo);
     if ((!timed_io) && (tmo > 0)) {
       if (pollresult == 0) {
         global_delta += tmo;
@@ -130,13 +381,18 @@ void dispatch (void)
     }
 #endif
     warn (LDEB,"Poll done",EDIS,0,2,pollresult);
-    if ((0 < onfds)
-     && (ufds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
-      command_process (ufds[0].revents & POLLIN);
+    if (0 < onfds) {
+      if (command_process (&ufds[0],onfds)) {
+        st = NULL; /* a command may have closed it, ask again below */
+      }
     }
-    if (bo
-     && (ufds[onfds].revents & (POLLOUT | POLLHUP | POLLERR))) {
-      output_something (ufds[onfds].revents & POLLOUT);
+    if (bo) {
+      while (onfds < infds) {
+        if (ufds[onfds].revents & (POLLOUT | POLLHUP | POLLERR)) {
+          output_something (ufds[onfds].fd,ufds[onfds].revents & POLLOUT);
+        }
+        onfds += 1;
+      }
     }
     output_gen_statistics ();
     if (bi) {
@@ -164,6 +420,14 @@ void dispatch (void)
     }
     if (st == NULL) {
       st = input_available ();
+      if ((st == NULL)
+       && input_expected ()
+       && output_acceptable ()) {
+        process_idle ();
+      }
+    }
+    if ((ufds = dispatch_pollfds ()) == NULL) {
+      break; /* clients may have connected meanwhile */
     }
     nfds = 0;
     command_expected (&nfds, &ufds[0]);
@@ -173,11 +437,17 @@ void dispatch (void)
   }
   process_finish ();
   output_finish ();
+  nfds = 0;
   while ((output_available (&nfds, &ufds[0], &tmo)
        || (tmo >= 0))
       && (!fatal_error)) {
-    output_something (TRUE);
+    while (nfds > 0) {
+      nfds -= 1;
+      output_something (ufds[nfds].fd,TRUE);
+    }
   }
+  warn (LIMP,"Wakeups",EDIS,0,4,cnt_wait);
+  warn (LIMP,"Idle wakeups",EDIS,0,5,cnt_idle);
 #ifdef DEBUG_TIMEPOLL
   {
     int i, u, s;
@@ -192,11 +462,11 @@ void dispatch (void)
         i,
         (int)logtp[i].tv.tv_sec,
         (int)logtp[i].tv.tv_usec,
-        logtp[i].msec_now,
+        (int)clock2msec (logtp[i].clock_now),
         u,
         logtp[i].flags & LTP_FLAG_DELTASHIFT ? 'D' : ' ',
         logtp[i].tmo,
-        logtp[i].cnt_msecnow,
+        logtp[i].cnt_clocknow,
         logtp[i].nfdsi,
         logtp[i].nfdso,
         logtp[i].flags & LTP_FLAG_INPUT ? 'I' : ' ',
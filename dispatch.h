@@ -24,5 +24,9 @@ extern boolean force_quit;
 extern boolean busy_work;
 
 boolean dispatch_init (void);
+boolean dispatch_setepoll (void);
+void dispatch_forget (int fd);
+void dispatch_drained (int fd,
+    short events);
 void dispatch (void);
 
@@ -29,7 +29,28 @@
 boolean timed_io;
 boolean accept_weird_scr;
 boolean conservative_pid_assignment;
-t_msec global_delta;
+t_clock global_delta;
+boolean pool_hugepages;
+
+/* Pool of fixed size blocks: each block size has a free list of its own,
+ * that blocks are handed back to and recycled from. Blocks are carved
+ * from slabs of POOL_SLAB bytes, one slab per block size at a time, or
+ * mapped on their own if larger. The address space is never returned to
+ * the system, so it only grows up to the highest demand seen, but the
+ * pages of blocks given up for smaller ones may be, see pool_trim.
+ */
+typedef struct {
+  int size;
+  int blocks; /* carved in total */
+  int idle; /* of these, in the free list */
+  void *free; /* free list, linked through the first word of each block */
+  byte *slab; /* rest of the current slab */
+  int slabrest;
+} pool_class;
+
+static pool_class pool [MAX_POOL_CLASSES];
+static int pool_classes;
+static uintptr_t pool_pagesize;
 
 #ifdef DEBUG_TIMEPOLL
 timepoll logtp [max_timepoll];
@@ -37,91 +58,258 @@ long logtpc;
 timepoll *ltp;
 #endif
 
-/* Provide the present system time in relative milliseconds.
+/* Provide the present system time in relative 27MHz ticks.
+ * The time base is monotonic, so it is not affected by setting the clock.
  * The zero point may be moved as unconditional waiting is proposed
  * in the dispatcher, but timed_io=FALSE.
- * Return: milliseconds
+ * Return: 27MHz ticks
  */
-t_msec msec_now (void)
+t_clock clock_now (void)
 {
-#define MSEC_EXPONENT 21
-  static long last;
-  static int local_delta;
-  struct timeval tv;
-  register int now;
-  gettimeofday (&tv,NULL);
+  struct timespec ts;
+  t_clock now;
+  clock_gettime (CLOCK_MONOTONIC,&ts);
 #ifdef DEBUG_TIMEPOLL
-  ltp->tv.tv_sec = tv.tv_sec;
-  ltp->tv.tv_usec = tv.tv_usec;
+  ltp->tv.tv_sec = ts.tv_sec;
+  ltp->tv.tv_usec = ts.tv_nsec / 1000;
 #endif
-  if ((tv.tv_sec & (~((1L << MSEC_EXPONENT) - 1))) != last) {
-    last = tv.tv_sec & (~((1L << MSEC_EXPONENT) - 1));
-    local_delta += 1000 * (1L << MSEC_EXPONENT);
-  }
-  now = (tv.tv_sec & ((1L << MSEC_EXPONENT) - 1)) * 1000
-      + tv.tv_usec / 1000 + local_delta;
-  warn (LDEB,"msec_now",EGLO,3,0,now);
+  now = (t_clock)ts.tv_sec * CLOCK_HZ
+      + ((t_clock)ts.tv_nsec * (CLOCK_HZ / 1000000)) / 1000;
+  warn (LDEB,"clock_now",EGLO,3,0,now);
 #ifdef DEBUG_TIMEPOLL
-  ltp->cnt_msecnow += 1;
-  ltp->msec_now = now + global_delta;
+  ltp->cnt_clocknow += 1;
+  ltp->clock_now = now + global_delta;
 #endif
   return (now + global_delta);
 }
 
-/* Convert a clock reference value (90kHz) to milliseconds,
+/* Convert a clock reference value (27MHz) to internal time,
  * using a conversion base to avoid wrap around errors.
  */
-void cref2msec (conversion_base *b,
+void cref2clock (conversion_base *b,
     clockref c,
-    t_msec *m)
+    t_clock *m)
 {
-#define CREF2MSEC_LIMIT (90 * 1024 * 16) /* 16 sec */
+#define CREF2CLOCK_LIMIT (90 * 1024 * 16) /* 16 sec */
   unsigned long d;
   d = c.base - b->base;
-  if (d >= (2 * CREF2MSEC_LIMIT)) {
-    if (d >= (3 * CREF2MSEC_LIMIT)) {
-      warn (LDEB,"cref2msec",EGLO,4,1,d);
-      b->base = c.base - CREF2MSEC_LIMIT;
-      b->msec = b->base / 90;
+  if (d >= (2 * CREF2CLOCK_LIMIT)) {
+    if (d >= (3 * CREF2CLOCK_LIMIT)) {
+      warn (LDEB,"cref2clock",EGLO,4,1,d);
+      b->base = c.base - CREF2CLOCK_LIMIT;
+      b->clock = (t_clock)b->base * 300;
     } else {
-      warn (LDEB,"cref2msec",EGLO,4,2,d);
-      b->base += CREF2MSEC_LIMIT;
-      b->msec += CREF2MSEC_LIMIT / 90;
+      warn (LDEB,"cref2clock",EGLO,4,2,d);
+      b->base += CREF2CLOCK_LIMIT;
+      b->clock += (t_clock)CREF2CLOCK_LIMIT * 300;
     }
     d = c.base - b->base;
   }
-  *m = (d / 90) + b->msec;
+  *m = (t_clock)d * 300 + c.ext + b->clock;
 }
  
-/* Convert milliseconds to a clock reference value (90kHz),
- * using a conversion base to avoid wrap around errors.
+/* Convert internal time to a clock reference value (27MHz).
+ * Both count the same ticks, so this is a mere modulo 2^33 on the base.
  */
-void msec2cref (conversion_base *b,
-    t_msec m,
+void clock2cref (t_clock m,
     clockref *c)
 {
-#define MSEC2CREF_LIMIT (1024 * 10) /* 10 sec */
-  unsigned int d;
-  d = m - b->msec;
-  if (d >= (2 * MSEC2CREF_LIMIT)) {
-    if (d >= (3 * MSEC2CREF_LIMIT)) {
-      warn (LDEB,"msec2cref",EGLO,5,1,d);
-      b->msec = m - MSEC2CREF_LIMIT;
-      b->base = b->msec * 45;
-    } else {
-      warn (LDEB,"msec2cref",EGLO,5,2,d);
-      b->msec += MSEC2CREF_LIMIT;
-      b->base += MSEC2CREF_LIMIT * 45;
-    }
-    d = m - b->msec;
+  t_clock b;
+  int e;
+  b = m / 300;
+  e = m % 300;
+  if (e < 0) {
+    e += 300;
+    b -= 1;
   }
-  d = (d * 45) + b->base;
-  c->base = d * 2;
-  c->ba33 = (d >> 31) & 0x01;
-  c->ext = 0;
+  c->base = (uint32_t)b;
+  c->ba33 = (b >> 32) & 0x01;
+  c->ext = e;
   c->valid = TRUE;
 }
 
+/* Make room in a growable table for at least need elements of size bytes.
+ * The table is doubled as often as necessary, new elements are zeroed.
+ * Precondition: table points to the table pointer, which is NULL
+ *               if *alloc==0
+ * Return: TRUE if successful, FALSE otherwise
+ */
+boolean table_reserve (void *table,
+    int *alloc,
+    int need,
+    int size)
+{
+  int n;
+  byte *t;
+  if (need <= *alloc) {
+    return (TRUE);
+  }
+  n = (*alloc > 0) ? *alloc : TABLE_MINIMUM;
+  while (n < need) {
+    n <<= 1;
+  }
+  if ((t = realloc (*(void **)table,n * size)) == NULL) {
+    warn (LERR,"Table Reserve",EGLO,5,*alloc,n);
+    return (FALSE);
+  }
+  memset (&t[*alloc * size],0,(n - *alloc) * size);
+  *(void **)table = t;
+  *alloc = n;
+  return (TRUE);
+}
+
+/* Map fresh memory for the pool, aligned to POOL_SLAB. With
+ * pool_hugepages, try explicit huge pages first, and else
+ * advise transparent huge pages.
+ * Precondition: size is a multiple of POOL_SLAB
+ * Return: pointer to the memory, NULL on failure
+ */
+static byte *pool_map (int size)
+{
+  byte *p;
+  int a;
+#ifdef MAP_HUGETLB
+  if (pool_hugepages) {
+    p = mmap (NULL,size,PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+    if (p != MAP_FAILED) {
+      return (p);
+    }
+    warn (LINF,"No hugetlb",EGLO,6,1,errno);
+  }
+#endif
+  p = mmap (NULL,size + POOL_SLAB,PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if (p == MAP_FAILED) {
+    warn (LERR,"Pool Map",EGLO,6,2,errno);
+    return (NULL);
+  }
+  a = (POOL_SLAB - ((uintptr_t)p & (POOL_SLAB - 1))) & (POOL_SLAB - 1);
+  if (a > 0) {
+    munmap (p,a);
+  }
+  munmap (p + a + size,POOL_SLAB - a);
+  p += a;
+#ifdef MADV_HUGEPAGE
+  if (pool_hugepages) {
+    madvise (p,size,MADV_HUGEPAGE);
+  }
+#endif
+  return (p);
+}
+
+/* Find the pool class for blocks of a given size, create it if needed.
+ * Precondition: size is a multiple of POOL_ALIGN
+ * Return: pointer to the class, NULL if there are too many classes
+ */
+static pool_class *pool_class_of (int size,
+    boolean create)
+{
+  int i;
+  pool_class *c;
+  i = pool_classes;
+  while (--i >= 0) {
+    if (pool[i].size == size) {
+      return (&pool[i]);
+    }
+  }
+  if ((!create)
+   || (pool_classes >= MAX_POOL_CLASSES)) {
+    return (NULL);
+  }
+  c = &pool[pool_classes++];
+  c->size = size;
+  c->blocks = 0;
+  c->idle = 0;
+  c->free = NULL;
+  c->slab = NULL;
+  c->slabrest = 0;
+  return (c);
+}
+
+/* Allocate a block of memory from the pool. If all block sizes
+ * are taken, fall back to malloc.
+ * Return: pointer to the block, NULL on failure
+ */
+void *pool_alloc (int size)
+{
+  pool_class *c;
+  byte *p;
+  int n;
+  size = (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+  if ((c = pool_class_of (size,TRUE)) == NULL) {
+    warn (LWAR,"Pool classes",EGLO,7,1,size);
+    return (malloc (size));
+  }
+  if ((p = c->free) != NULL) {
+    c->free = *(void **)p;
+    c->idle -= 1;
+    return (p);
+  }
+  if (c->slabrest < size) {
+    n = (size > POOL_SLAB) ?
+        (size + POOL_SLAB - 1) & ~(POOL_SLAB - 1) : POOL_SLAB;
+    if ((p = pool_map (n)) == NULL) {
+      return (NULL);
+    }
+    c->slab = p;
+    c->slabrest = n;
+  }
+  p = c->slab;
+  c->slab += size;
+  c->slabrest -= size;
+  c->blocks += 1;
+  warn (LDEB,"Pool grow",EGLO,7,size,c->blocks);
+  return (p);
+}
+
+/* Hand a block back to the pool for reuse.
+ * Precondition: p==NULL, or p was returned by pool_alloc for the same size
+ */
+void pool_free (void *p,
+    int size)
+{
+  pool_class *c;
+  if (p == NULL) {
+    return;
+  }
+  size = (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+  if ((c = pool_class_of (size,FALSE)) == NULL) {
+    free (p);
+    return;
+  }
+  *(void **)p = c->free;
+  c->free = p;
+  c->idle += 1;
+}
+
+/* Give the whole pages within a block back to the system, before the
+ * block is handed back with pool_free, so that e.g. a ring shrunk to a
+ * fraction does not keep the memory of its former size. Blocks that are
+ * recycled as they are, do not need this. Huge pages are kept, as they
+ * would be split.
+ * Precondition: p==NULL, or p was returned by pool_alloc for the same size
+ */
+void pool_trim (void *p,
+    int size)
+{
+  uintptr_t a, e;
+  if ((p == NULL)
+   || pool_hugepages) {
+    return;
+  }
+  size = (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
+  if (pool_class_of (size,FALSE) == NULL) {
+    return;
+  }
+  a = ((uintptr_t)p + sizeof (void *) + pool_pagesize - 1)
+    & ~(pool_pagesize - 1);
+  e = ((uintptr_t)p + size) & ~(pool_pagesize - 1);
+  if (e > a) {
+    madvise ((void *)a,e - a,MADV_DONTNEED);
+  }
+}
+
 void global_init (void)
 {
 #ifdef DEBUG_TIMEPOLL
@@ -136,9 +324,12 @@ void global_init (void)
 #endif
   verbose_level = LWAR;
   global_delta = 0;
-  global_delta = - msec_now ();
+  global_delta = - clock_now ();
   timed_io = FALSE;
   accept_weird_scr = FALSE;
   conservative_pid_assignment = FALSE;
+  pool_hugepages = FALSE;
+  pool_classes = 0;
+  pool_pagesize = sysconf (_SC_PAGESIZE);
 }
 
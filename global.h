@@ -21,13 +21,18 @@
 #include <stdint.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <semaphore.h>
 
 /* for a timing and poll profile: */
 #if 0
@@ -49,50 +54,86 @@
 
 #define MAX_DATA_COMB 512
 #define HIGHWATER_COM 8
+#define MAX_COMMAND_CLIENTS 16 /* connected to the control socket at a time */
+#define MAX_DATA_COMR 1024 /* acknowledgements collected before sending */
 
 #define MAX_CTRL_OUTB (1 << 16)
 #define MAX_DATA_OUTB (MAX_CTRL_OUTB << 7)
 #define HIGHWATER_OUT 512
-#define MAX_WRITE_OUT (44 * TS_PACKET_SIZE)
+#define MAX_WRITE_OUT (44 * TS_PACKET_SIZE) /* initial burst size */
+#define MAX_WRITE_IOV 1024 /* segments per burst, IOV_MAX of linux */
+#define MAX_DGRAM_PACKETS 7 /* TS packets per UDP datagram */
+#define MAX_DGRAM_BURST 64 /* UDP datagrams per send operation */
+#define MAX_DGRAM_IOV 16 /* segments per UDP datagram */
+#define MAX_DGRAM_IN 2048 /* largest UDP payload accepted per datagram */
+#define MAX_NET_REORDER (2 * MAX_DGRAM_BURST) /* RTP datagrams held back */
+#define MAX_NET_ARRIVAL (1 << 11) /* arrival times kept per network input */
+#define MAX_MSEC_REORDER 50 /* longest wait for a missing RTP datagram */
+#define NET_RCVBUF (1 << 22) /* socket receive buffer asked for */
+
+#define RTP_HEADER_SIZE 12
+#define RTP_VERSION 0x80
+#define RTP_PAYLOAD_MP2T 33 /* RFC 3551 */
 
 #define MAX_CTRL_INB  (1 << 10)
 #define MAX_DATA_INBV (MAX_CTRL_INB << 10)
 #define MAX_DATA_INBA (MAX_CTRL_INB << 9)
 #define MAX_DATA_INB  (MAX_CTRL_INB << 9)
 #define MAX_DATA_INBPSI (MAX_CTRL_INB << 6)
+#define MIN_DATA_INBADAPT (MAX_CTRL_INB << 4) /* bounds of adapted rings */
+#define MAX_DATA_INBADAPT (MAX_CTRL_INB << 14)
+#define MIN_CTRL_INBADAPT (1 << 6)
+#define MAX_CTRL_INBADAPT (1 << 14)
+#define MSEC_ADAPT_INB 1000 /* period the stream rate is measured over */
 #define HIGHWATER_IN  (16 * 1024)
 
 #define MAX_DATA_RAWB (1 << 18)
+#define MAX_DATA_RAWM (1 << 21) /* regular files, two halves mapped in turn */
 #define HIGHWATER_RAW (16 * 1024)
 #define MAX_READ_IN   (8 * 1024)
 
-#define MAX_INSTREAM  64 /* ? */
-#define MAX_INFILE    8  /* ? */
-
 #define MAX_STRPERPS  (1<<8)
 #define MAX_STRPERTS  (1<<13)
 
 #define MAX_DESCR_LEN 0xFF
 #define MAX_PSI_SIZE  (4096+1)
 #define CAN_PSI_SIZE  (1024+1)
+#define MAX_PSI_SECTION (CAN_PSI_SIZE-1) /* PAT/PMT, section_length<=1021 */
 #define MAX_PMTSTREAMS (CAN_PSI_SIZE / 4)
 
-#define MAX_STRPERPRG 42 /* ? */
-#define MAX_OUTPROG   32  /* ? */
-#define MAX_PRGFORSTR MAX_OUTPROG
+#define MAX_STRPERPRG 42 /* ? program stream, limited by psi size */
+
+#define MAX_POLLFD_FIX 3 /* command and output, besides input files and sinks */
 
-#define MAX_POLLFD    (MAX_INFILE+3)
+#define TABLE_MINIMUM 8 /* initial number of elements of growable tables */
+#define POOL_SLAB  (1 << 21) /* pool memory is mapped in units of this */
+#define POOL_ALIGN 64 /* pool block sizes are rounded up to this */
+#define MAX_POOL_CLASSES 64 /* distinct block sizes kept in the pool */
+#define HASH_SIZE     64 /* number of buckets of hash indexes, power of 2 */
 
 #define ENDSTR_KILL      0
 #define ENDSTR_CLOSE     1
 #define ENDSTR_WAIT      2
 
+#define PASS_NONE    0 /* split into PES packets, packetize again */
+#define PASS_PCR     1 /* keep TS packets, pass PCR unchanged */
+#define PASS_RESTAMP 2 /* keep TS packets, restamp PCR */
+
 #define boolean uint8_t
 #define FALSE   0
 #define TRUE    1
 
 #define byte uint8_t
 #define t_msec int32_t
+#define t_clock int64_t
+
+/* Internal time base: 27MHz ticks of CLOCK_MONOTONIC, i.e. the resolution
+ * of the ISO 13818 system clock. Durations set by the user stay in msec.
+ */
+#define CLOCK_HZ   27000000
+#define CLOCK_MSEC (CLOCK_HZ / 1000)
+#define msec2clock(m) ((t_clock)(m) * CLOCK_MSEC)
+#define clock2msec(c) ((t_msec)((c) / CLOCK_MSEC))
 
 /* ISO 13818 clock reference 90kHz (33 bit) with 27MHz extension (9 bit).
  * ba33 holds the high bit of base.
@@ -105,12 +146,12 @@ typedef struct {
 } clockref;
 
 /* For conversion purposes, this pair of values holds a partial clock
- * reference and an internal value in milliseconds. This is to eliminate
+ * reference and an internal time value. This is to eliminate
  * wrapping faults without producing conversion inaccuracies.
  */
 typedef struct {
   uint32_t base;
-  t_msec msec;
+  t_clock clock;
 } conversion_base;
 
 /* On reference to a controlled data buffer, this one holds the control
@@ -122,8 +163,8 @@ typedef struct {
   int index;
   int length;
   int sequence;
-  t_msec msecread;
-  t_msec msecpush;
+  t_clock clockread;
+  t_clock clockpush;
   clockref pcr;
   clockref opcr;
   byte scramble;
@@ -150,13 +191,18 @@ typedef struct {
 #define list_create(refr,size) \
   ((((size) & ((size)-1)) || (size < 2)) ? \
      warn (LERR,"List Create",EGLO,1,1,size), FALSE : \
-   ((refr).ptr = malloc((size) * sizeof(*(refr).ptr))) == NULL ? \
+   ((refr).ptr = pool_alloc((size) * sizeof(*(refr).ptr))) == NULL ? \
      warn (LERR,"List Create",EGLO,1,2,size), FALSE : \
    ((refr).mask = (size)-1, (refr).in = (refr).out = 0, TRUE))
 
-/* Release a buffer no longer used */
+/* Release a buffer no longer used, handing it back to the pool */
 #define list_release(refr) \
-  ((refr).mask = 0, free((refr).ptr), (refr).ptr = NULL)
+  (pool_free((refr).ptr,((refr).mask+1) * sizeof(*(refr).ptr)), \
+   (refr).mask = 0, (refr).ptr = NULL)
+
+/* Give the pages of a buffer back to the system, before it is released */
+#define list_trim(refr) \
+  pool_trim((refr).ptr,((refr).mask+1) * sizeof(*(refr).ptr))
 
 /* Test on buffer emptiness */
 #define list_empty(refr) ((refr).out == (refr).in)
@@ -208,8 +254,10 @@ typedef struct {
 #define mmax(a,b) ((a)<(b)?(b):(a))
 
 /* Allocate memory for a struct with known union usage */
+#define unionsize(typ,fld) \
+  (sizeof(typ)-sizeof(((typ*)0)->u)+sizeof(((typ*)0)->u.fld))
 #define unionalloc(typ,fld) \
-  (malloc (sizeof(typ)-sizeof(((typ*)0)->u)+sizeof(((typ*)0)->u.fld)))
+  (malloc (unionsize(typ,fld)))
 
 /* Release a chained list completely */
 #define releasechain(typ,root) \
@@ -227,6 +275,12 @@ typedef enum {
 } content_type;
 
 /* stream data types, dependend on buffer contents */
+typedef enum {
+  sp_block,      /* sink lagging behind makes all sinks wait */
+  sp_drop,       /* sink lagging behind drops data that is due */
+  sp_disconnect  /* sink lagging behind is closed */
+} sink_policy;
+
 typedef enum {
   sd_data,       /* PES packet */
   sd_map,        /* mapreference containing descriptors */
@@ -264,6 +318,7 @@ typedef struct tsautodescr {
   int tprg;
   int ssid; /* ssid<0 when referencing a complete program */
   int tsid;
+  byte pass; /* PASS_* */
 } tsauto_descr;
 
 /* Declaration of pid ranges as being not-to-be-parsed SI */
@@ -273,8 +328,47 @@ typedef struct tssidescr {
   short pid_high;
 } tssi_descr;
 
+/* Classification of source TS PIDs, to dispatch packets when splitting */
+typedef enum {
+  pc_resync,     /* reserved PID, dropped */
+  pc_pat,        /* program association table */
+  pc_data,       /* open data stream */
+  pc_psi,        /* open map stream, i.e. PMT */
+  pc_pcronly,    /* no stream open, but carries PCR of a program */
+  pc_auto,       /* no stream open, but may be opened automatically */
+  pc_unparsedsi, /* in a not-to-be-parsed SI range */
+  pc_drop,       /* not used */
+  number_pc
+} pid_class;
+
 /* Source file */
 typedef struct {
+  uint32_t offset; /* bytes received before the datagram */
+  t_clock arrival; /* time of reception */
+} net_arrival;
+
+typedef struct {
+  boolean rtp; /* datagrams carry an RTP header (RFC 2250) */
+  boolean started; /* expect and stamp are valid */
+  uint16_t expect; /* next RTP sequence number to be stored */
+  uint32_t stamp; /* last RTP time stamp seen */
+  t_clock rtpclock; /* last RTP time stamp, unwrapped, in 27MHz ticks */
+  t_clock transit; /* arrival time minus rtpclock, low end, slowly rising */
+  uint32_t received; /* bytes stored into the raw buffer, total */
+  long datagrams; /* received, total */
+  long lost; /* missing in the RTP sequence */
+  long reordered; /* received ahead of a predecessor */
+  long late; /* received after being declared lost, or duplicate */
+  long damaged; /* truncated or bad RTP header */
+  int held; /* number of datagrams held back for reordering */
+  short heldlen[MAX_NET_REORDER]; /* 0 if the slot is empty */
+  t_clock heldarrival[MAX_NET_REORDER];
+  byte helddata[MAX_NET_REORDER][MAX_DGRAM_IN];
+  int arrin, arrout; /* arrival ring, arrout is the oldest entry */
+  net_arrival arrival[MAX_NET_ARRIVAL];
+} net_descr;
+
+typedef struct filedescr {
   refr_data data;
   int handle;
   char *name;
@@ -293,10 +387,24 @@ typedef struct {
   int auto_programnb;
   boolean automatic; /* extract'o'use */
   boolean stopfile;
+  boolean mmapped; /* data buffer is a window to map the file into */
+  boolean mapchunk; /* next chunk is to be mapped (not read) */
+  off_t mapoffset; /* file position corresponding to data.in */
+  struct filedescr *hash_name; /* next in input's name index bucket */
+  struct filedescr *hash_refnum; /* next in input's filerefnum index bucket */
+  boolean threaded; /* a split thread is running for this file */
+  boolean threadquit; /* the split thread is to terminate */
+  boolean threadresult; /* result of the last split round of the thread */
+  pthread_t thread;
+  sem_t threadgo; /* posted to start a split round of the thread */
+  net_descr *net; /* UDP or RTP reception, NULL for other files */
   content_type content;
   union {
     struct {
       struct streamdescr *stream;
+      boolean timed; /* a PTS or DTS was found */
+      t_clock clocktime; /* push time of the last packet */
+      conversion_base conv;
     } pes;
     struct {
       struct {
@@ -327,8 +435,19 @@ typedef struct {
       pmt_descr *pat;
       pmt_descr *newpat;
       tsauto_descr *tsauto;
+      byte autopass; /* PASS_* for automatic streams */
       tssi_descr *tssi;
       struct streamdescr *stream[MAX_STRPERTS];
+      boolean pidclass_valid;
+      byte pidclass[MAX_STRPERTS]; /* pid_class per PID */
+      boolean autounlisted; /* streams not listed in a PMT may be opened */
+      int filterpos; /* raw data up to here is filtered, -1 if no sync */
+      int stride; /* packet stride in raw data, 0 if not in sync */
+      int synclocks; /* sync events since last statistics */
+      int syncunlocks;
+      boolean arrivalvalid;
+      uint32_t arrivalstamp; /* last M2TS arrival time stamp */
+      t_clock arrival; /* the same, without wrapping */
     } ts;
   } u;
 } file_descr;
@@ -352,18 +471,32 @@ typedef struct stumpdescr {
   descr_descr manudescr;
 } stump_descr;
 
-/* Target program */
+/* PSI section, ready made as a sequence of TS packets, so that on
+ * repetition only the continuity counters have to be patched.
+ */
+#define MAX_PSI_PACKETS \
+  ((MAX_PSI_SIZE + TS_PACKET_SIZE - 4 - 1) / (TS_PACKET_SIZE - 4))
 typedef struct {
+  short packets; /* 0, if to be rebuilt */
+  byte data[MAX_PSI_PACKETS][TS_PACKET_SIZE];
+} psi_packets;
+
+/* Target program */
+typedef struct progdescr {
+  struct progdescr *hash_next; /* next in splicets' program number index */
   int program_number;
   short pcr_pid;
   short pmt_pid;
   byte pmt_conticnt;
   byte pmt_version;
   boolean changed; /* must generate new psi due to change */
-  boolean unchanged; /* must generate new psi due to timing */
+  boolean unchanged; /* must regenerate psi, but keep the version */
+  boolean repeat; /* must repeat psi due to timing */
+  psi_packets pmt_packets; /* splicets: PMT as sent last */
   short pat_section;
-  short streams;
-  struct streamdescr *stream[MAX_STRPERPRG];
+  int streams;
+  int stream_alloc;
+  struct streamdescr **stream;
   stump_descr *stump; /* just entries in PMT, not really data streams */
   descr_descr manudescr;
 } prog_descr;
@@ -392,15 +525,24 @@ typedef struct streamdescr {
       boolean has_clockref; /* in output */
       boolean has_opcr; /* in input */
       struct streamdescr *mapstream;
-      t_msec next_clockref;
-      t_msec delta;
-      conversion_base conv;
-      t_msec lasttime;
-      short progs;
-      prog_descr *pdescr[MAX_PRGFORSTR];
+      t_clock next_clockref;
+      t_clock delta;
+      t_clock lasttime;
+      int progs;
+      int pdescr_alloc;
+      prog_descr **pdescr;
+      int outrefs; /* payloads left in data for the output */
+      int outdone; /* data.out as far as not left for the output */
+      int maxlength; /* largest PES split or announced, for ring sizes */
+      int payload; /* bytes split since ratetime */
+      int packets; /* ctrl entries split since ratetime */
+      t_clock ratetime; /* push time the rate measurement started with */
+      boolean ratevalid;
+      byte pass; /* PASS_*, data holds TS packets if not PASS_NONE */
     } d;
     struct {
-      t_msec msectime;
+      t_clock clocktime;
+      t_clock pcrarrival; /* M2TS arrival of the last PCR, -1 if none */
       conversion_base conv;
       int psi_length;
       byte psi_data[MAX_PSI_SIZE+TS_PACKET_SIZE];
@@ -414,18 +556,31 @@ typedef struct streamdescr {
 extern boolean timed_io;
 extern boolean accept_weird_scr;
 extern boolean conservative_pid_assignment;
-extern t_msec global_delta;
+extern t_clock global_delta;
+extern boolean pool_hugepages;
 
-t_msec msec_now (void);
+t_clock clock_now (void);
 
-void cref2msec (conversion_base *b,
+void cref2clock (conversion_base *b,
     clockref c,
-    t_msec *m);
+    t_clock *m);
 
-void msec2cref (conversion_base *b,
-    t_msec m,
+void clock2cref (t_clock m,
     clockref *c);
 
+boolean table_reserve (void *table,
+    int *alloc,
+    int need,
+    int size);
+
+void *pool_alloc (int size);
+
+void pool_free (void *p,
+    int size);
+
+void pool_trim (void *p,
+    int size);
+
 void global_init (void);
 
 
@@ -435,11 +590,11 @@ void global_init (void);
 
 typedef struct {
   struct timeval tv;
-  t_msec msec_now;
+  t_clock clock_now;
   int usec;
   int tmo;
   int sr, si, so;
-  unsigned char cnt_msecnow;
+  unsigned char cnt_clocknow;
   unsigned char nfdso, nfdsi;
   unsigned char nfdsrevent;
   unsigned char flags;
@@ -47,10 +47,10 @@ static void system_init ()
 int main (int argc,
     char *argv[])
 {
-  int a;
+  t_clock a;
   system_init ();
   global_init ();
-  a = msec_now ();
+  a = clock_now ();
   gen_crc32_table ();
   if (input_init ()) {
     if (output_init ()) {
@@ -61,11 +61,12 @@ int main (int argc,
 #ifdef DEBUG_TIMEPOLL
             warn (LDEB,"Global delta",EINI,0,0,global_delta);
             warn (LERR,"(msec) Exit Time ",EINI,0,0,
-              msec_now () - a);
+              clock2msec (clock_now () - a));
             warn (LERR,"(msec) Exit Clock",EINI,0,0,
               clock ()/(CLOCKS_PER_SEC/1000));
 #endif
           }
+          command_finish ();
           exit (EXIT_SUCCESS);
         } else {
           warn (LERR,"Dispatch Fail",EINI,0,6,0);
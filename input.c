@@ -31,6 +31,10 @@
  * (raw) file input buffers.
  */
 
+#define _GNU_SOURCE /* recvmmsg */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
 #include "global.h"
 #include "error.h"
 #include "pes.h"
@@ -39,30 +43,49 @@
 #include "splitts.h"
 #include "splice.h"
 #include "input.h"
+#include "dispatch.h"
 #include "descref.h"
 #include "ts.h"
+#include "output.h"
 
 /* index of files in use, containing i.a. the raw input data buffers:
  */
-static file_descr *inf [MAX_INFILE];
+static file_descr **inf;
+static int inf_alloc;
 static int in_files;
 static int in_openfiles[number_ct];
 
+/* lookup of files in use, by handle, by name and by filerefnum:
+ */
+static file_descr **inf_handle;
+static int inf_handles;
+static file_descr *inf_name [HASH_SIZE];
+static file_descr *inf_refnum [HASH_SIZE];
+
 /* index of streams in use, containing i.a. the input pes buffers:
  */
-static stream_descr *ins [MAX_INSTREAM];
+static stream_descr **ins;
+static int ins_alloc;
 static int in_streams;
 static int in_openstreams[number_sd];
 
 static t_msec trigger_msec_input;
 
+/* split threads for TS files, see input_splitparallel:
+ */
+static boolean split_threads;
+static sem_t split_done;
+
 boolean input_init (void)
 {
   in_files = 0;
   memset (in_openfiles, 0, sizeof (in_openfiles));
+  memset (inf_name, 0, sizeof (inf_name));
+  memset (inf_refnum, 0, sizeof (inf_refnum));
   in_streams = 0;
   memset (in_openstreams, 0, sizeof (in_openstreams));
   trigger_msec_input = TRIGGER_MSEC_INPUT;
+  split_threads = FALSE;
   return (TRUE);
 }
 
@@ -82,6 +105,200 @@ int deb_instr_free (int s)
 }
 #endif
 
+/* Compute the name index bucket for a file name.
+ * Return: bucket number
+ */
+static int input_namehash (char *name)
+{
+  unsigned int h;
+  h = 0;
+  while (*name != 0) {
+    h = (h * 31) + (byte)*name++;
+  }
+  return (h & (HASH_SIZE - 1));
+}
+
+/* Enter a file into the lookup indexes, using its current
+ * handle, name and filerefnum.
+ * Precondition: f!=NULL, f->name!=NULL, f not indexed
+ * Return: TRUE if successful, FALSE otherwise
+ */
+static boolean input_indexfile (file_descr *f)
+{
+  int h;
+  if (f->handle >= 0) {
+    if (!table_reserve (&inf_handle,&inf_handles,
+          f->handle + 1,sizeof (*inf_handle))) {
+      return (FALSE);
+    }
+    inf_handle[f->handle] = f;
+  }
+  h = input_namehash (f->name);
+  f->hash_name = inf_name[h];
+  inf_name[h] = f;
+  h = f->filerefnum & (HASH_SIZE - 1);
+  f->hash_refnum = inf_refnum[h];
+  inf_refnum[h] = f;
+  return (TRUE);
+}
+
+/* Remove a file from the lookup indexes. Handle, name and filerefnum
+ * must not have been changed since it was entered.
+ * Precondition: f!=NULL, f indexed
+ */
+static void input_unindexfile (file_descr *f)
+{
+  file_descr **p;
+  if ((f->handle >= 0)
+   && (f->handle < inf_handles)
+   && (inf_handle[f->handle] == f)) {
+    inf_handle[f->handle] = NULL;
+  }
+  p = &inf_name[input_namehash (f->name)];
+  while (*p != NULL) {
+    if (*p == f) {
+      *p = f->hash_name;
+      break;
+    }
+    p = &(*p)->hash_name;
+  }
+  p = &inf_refnum[f->filerefnum & (HASH_SIZE - 1)];
+  while (*p != NULL) {
+    if (*p == f) {
+      *p = f->hash_refnum;
+      break;
+    }
+    p = &(*p)->hash_refnum;
+  }
+}
+
+/* Determine the number of files in use, i.e. the number of
+ * handles input_acceptable may ask for at most.
+ * Return: number of files
+ */
+int input_filecount (void)
+{
+  return (in_files);
+}
+
+/* Split thread of a TS file. Each round is started by the dispatcher
+ * and reported back, see input_splitparallel.
+ * Precondition: arg is the file
+ */
+static void *input_splitthread (void *arg)
+{
+  file_descr *f = arg;
+  while (TRUE) {
+    while ((sem_wait (&f->threadgo) != 0)
+        && (errno == EINTR)) {
+    }
+    if (f->threadquit) {
+      return (NULL);
+    }
+    f->threadresult = split_ts_parallel (f);
+    sem_post (&split_done);
+  }
+}
+
+/* Start the split thread of a TS file.
+ * Precondition: f!=NULL, !f->threaded
+ * Return: TRUE if successful, FALSE otherwise
+ */
+static boolean input_startthread (file_descr *f)
+{
+  int e;
+  if (sem_init (&f->threadgo,0,0) == 0) {
+    f->threadquit = FALSE;
+    if ((e = pthread_create (&f->thread,NULL,input_splitthread,f)) == 0) {
+      f->threaded = TRUE;
+      return (TRUE);
+    }
+    sem_destroy (&f->threadgo);
+  } else {
+    e = errno;
+  }
+  warn (LWAR,"Thread fail",EINP,16,1,e);
+  return (FALSE);
+}
+
+/* Terminate the split thread of a file, if any.
+ * Precondition: f!=NULL
+ */
+static void input_stopthread (file_descr *f)
+{
+  if (f->threaded) {
+    f->threadquit = TRUE;
+    sem_post (&f->threadgo);
+    pthread_join (f->thread,NULL);
+    sem_destroy (&f->threadgo);
+    f->threaded = FALSE;
+  }
+}
+
+/* Enable concurrent splitting of TS files.
+ * Return: TRUE if successful, FALSE otherwise
+ */
+boolean input_setthreads (void)
+{
+  if (sem_init (&split_done,0,0) != 0) {
+    warn (LWAR,"Thread fail",EINP,16,2,errno);
+    return (FALSE);
+  }
+  split_threads = TRUE;
+  return (TRUE);
+}
+
+/* Split the TS files concurrently, each in a thread of its own, as far
+ * as this does not touch anything but the file and its data streams
+ * (see split_ts_parallel). Only files with a fair amount of raw data are
+ * worth a thread round. Wait for all of them to finish the round, so
+ * that the serial split_something that follows continues from the same
+ * state as if the files were split one after the other, and neither the
+ * ring buffers nor anything else need further synchronization.
+ * Return: TRUE, if something was processed, FALSE otherwise
+ */
+static boolean input_splitparallel (void)
+{
+  int i, n;
+  file_descr *f;
+  boolean r = FALSE;
+  n = 0;
+  i = in_files;
+  while (--i >= 0) {
+    if ((inf[i]->content == ct_transport)
+     && (list_size (inf[i]->data) >= HIGHWATER_RAW)) {
+      n += 1;
+    }
+  }
+  if (n < 2) {
+    return (FALSE);
+  }
+  n = 0;
+  i = in_files;
+  while (--i >= 0) {
+    f = inf[i];
+    f->threadresult = FALSE;
+    if ((f->content == ct_transport)
+     && (list_size (f->data) >= HIGHWATER_RAW)
+     && (f->threaded || input_startthread (f))) {
+      sem_post (&f->threadgo);
+      n += 1;
+    }
+  }
+  while (--n >= 0) {
+    while ((sem_wait (&split_done) != 0)
+        && (errno == EINTR)) {
+    }
+  }
+  i = in_files;
+  while (--i >= 0) {
+    if (inf[i]->threadresult) {
+      r = TRUE;
+    }
+  }
+  return (r);
+}
+
 /* Determine whether data is expected as input.
  * Return: TRUE, if any valuable file is open, FALSE otherwise
  */
@@ -99,6 +316,143 @@ void input_settriggertiming (t_msec time)
   trigger_msec_input = time;
 }
 
+/* Chunk size for mapped files, i.e. half the raw data buffer */
+#define MAPCHUNK(f) (((f)->data.mask + 1) / 2)
+
+/* Replace the raw data buffer of a regular file by a window, that the file
+ * is mapped into chunkwise (see input_mapchunk), to avoid copying.
+ * On failure, keep the buffer allocated before, and use read instead.
+ * Precondition: f!=NULL, list_empty(f->data)
+ */
+static void input_mapinit (file_descr *f)
+{
+  void *p;
+  p = mmap (NULL,MAX_DATA_RAWM,PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if (p == MAP_FAILED) {
+    warn (LWAR,"Map init fail",EINP,15,1,errno);
+    return;
+  }
+  list_release (f->data);
+  f->data.ptr = p;
+  f->data.mask = MAX_DATA_RAWM - 1;
+  f->data.in = f->data.out = 0;
+  f->mmapped = TRUE;
+  f->mapchunk = TRUE;
+}
+
+/* Check whether the next chunk can be mapped now. This is the case, if
+ * buffer index and file position are both at a chunk boundary and the
+ * half to be mapped is free, or if so few data are left in the buffer,
+ * that these can be moved to realign them.
+ * Precondition: f!=NULL, f->mmapped
+ * Return: TRUE if ready, FALSE otherwise
+ */
+static boolean input_mapready (file_descr *f)
+{
+  int h;
+  h = MAPCHUNK (f);
+  if (((f->data.in & (h-1)) == 0)
+   && ((f->mapoffset & (h-1)) == 0)) {
+    return (list_free (f->data) >= h);
+  }
+  return (list_size (f->data) <= h/2);
+}
+
+/* Map the next chunk of a regular file into the raw data buffer.
+ * The buffer consists of two halves, each of which is replaced by a private
+ * mapping of the next chunk of the file as soon as it has been consumed, so
+ * that the splitters work on the file contents directly. If index and file
+ * position disagree (after repeat or append), the data left in the buffer
+ * are moved to realign. The last partial chunk of a file is to be read.
+ * Precondition: f!=NULL, f->mmapped, f->mapchunk
+ * Return: number of bytes made available, 0 if to be read instead,
+ *         -1 if not ready yet.
+ */
+static int input_mapchunk (file_descr *f)
+{
+  struct stat stat;
+  byte *d, *t;
+  off_t c;
+  int h, l, n, i;
+  boolean realign;
+  if (!input_mapready (f)) {
+    return (-1);
+  }
+  h = MAPCHUNK (f);
+  l = f->mapoffset & (h-1);
+  c = f->mapoffset - l;
+  if ((fstat (f->handle,&stat) != 0)
+   || (c + h > stat.st_size)) {
+    warn (LDEB,"Map tail",EINP,15,2,f->mapoffset);
+    f->mapchunk = FALSE;
+    return (0);
+  }
+  t = NULL;
+  n = 0;
+  realign = ((f->data.in & (h-1)) != 0) || (l != 0);
+  if (realign) {
+    n = list_size (f->data);
+    if (n > 0) {
+      if ((t = malloc (n)) == NULL) {
+        warn (LERR,"Alloc fail",EINP,15,3,n);
+        f->mapchunk = FALSE;
+        return (0);
+      }
+      i = f->data.mask + 1 - f->data.out;
+      if (i > n) {
+        i = n;
+      }
+      memcpy (t,&f->data.ptr[f->data.out],i);
+      memcpy (&t[i],&f->data.ptr[0],n-i);
+    }
+    warn (LIMP,"Map realign",EINP,15,4,n);
+    f->data.in = l;
+  }
+  d = &f->data.ptr[f->data.in & ~(h-1)];
+  if (mmap (d,h,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_FIXED,f->handle,c)
+      == MAP_FAILED) {
+    warn (LWAR,"Map fail",EINP,15,5,errno);
+    if (mmap (d,h,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED,
+              -1,0) == MAP_FAILED) {
+      warn (LERR,"Map fail",EINP,15,6,errno);
+      fatal_error = TRUE;
+    }
+    f->mapchunk = FALSE;
+    l = 0;
+  } else {
+    madvise (d,h,MADV_SEQUENTIAL);
+    l = h - l;
+    lseek (f->handle,f->mapoffset+l,SEEK_SET);
+  }
+  if (t != NULL) {
+    f->data.out = (f->data.in - n) & f->data.mask;
+    i = f->data.mask + 1 - f->data.out;
+    if (i > n) {
+      i = n;
+    }
+    memcpy (&f->data.ptr[f->data.out],t,i);
+    memcpy (&f->data.ptr[0],&t[i],n-i);
+    free (t);
+  } else if (realign) {
+    f->data.out = f->data.in;
+  }
+  warn (LDEB,"Map",EINP,15,7,l);
+  return (l);
+}
+
+/* Check whether a file's raw data buffer has space for new data.
+ * Precondition: f!=NULL
+ * Return: TRUE if new data is acceptable, FALSE otherwise
+ */
+static boolean input_rawacceptable (file_descr *f)
+{
+  if (f->mmapped && f->mapchunk) {
+    return (input_mapready (f));
+  }
+  return (list_free (f->data) >= HIGHWATER_RAW);
+}
+
 /* Determine whether input data is acceptable, i.e. there is space in buffers.
  * If so, set the poll struct accordingly for each file in question.
  * Check the streams for time stamps and set the timeout^ accordingly,
@@ -108,12 +462,12 @@ void input_settriggertiming (t_msec time)
  */
 boolean input_acceptable (unsigned int *nfds,
     struct pollfd *ufds,
-    t_msec *timeout,
+    t_clock *timeout,
     boolean outnotfull)
 {
   boolean accept = FALSE;
   int i;
-  t_msec t, now;
+  t_clock t, now;
   file_descr *f;
   stream_descr *s;
   i = in_files;
@@ -121,7 +475,7 @@ boolean input_acceptable (unsigned int *nfds,
     f = inf[i];
     warn (LDEB,"Acceptable",EINP,2,1,i);
     warn (LDEB,"Free Raw",EINP,2,2,list_free (f->data));
-    if ((list_free (f->data) >= HIGHWATER_RAW)
+    if ((input_rawacceptable (f))
      && (f->handle >= 0)) {
       ufds->fd = f->handle;
       ufds->events = POLLIN;
@@ -133,16 +487,17 @@ boolean input_acceptable (unsigned int *nfds,
     }
   }
   if (outnotfull) {
-    now = msec_now ();
+    now = clock_now ();
     i = in_streams;
     while (--i >= 0) {
       s = ins[i];
       if (s->streamdata == sd_data) {
         if (!list_empty (s->ctrl)) {
           if (s->u.d.trigger) {
-            t = s->ctrl.ptr[s->ctrl.out].msecpush - now + s->u.d.delta;
+            t = s->ctrl.ptr[s->ctrl.out].clockpush - now + s->u.d.delta;
           } else {
-            t = s->ctrl.ptr[s->ctrl.out].msecread - now + trigger_msec_input;
+            t = s->ctrl.ptr[s->ctrl.out].clockread - now
+              + msec2clock (trigger_msec_input);
           }
           if ((t > 0)
            && ((*timeout < 0)
@@ -158,17 +513,34 @@ boolean input_acceptable (unsigned int *nfds,
 
 /* Set the trigger on a stream, enabling the data to be spliced now.
  * Set the trigger for all streams that correspond thru the target program, too
+ * PES streams that are timed by PTS/DTS share the delta of the stream
+ * that caused the trigger, so that the lead or lag between them is kept,
+ * as far as it is within the allowed jitter.
  * Precondition: s!=NULL
  */
 static void set_trigger (stream_descr *s,
-    t_msec now)
+    t_clock now,
+    stream_descr *r)
 {
   int q, i;
+  t_clock t;
   prog_descr *p;
-  if (!list_empty (s->data)) {
-    s->u.d.lasttime = now;
+  if (((s->u.d.outrefs > 0) ? s->u.d.outdone : s->data.out)
+      != s->data.in) {
     s->u.d.delta =
-      now - s->ctrl.ptr[s->ctrl.out].msecpush;
+      now - s->ctrl.ptr[s->ctrl.out].clockpush;
+    if ((r != NULL)
+     && (s->fdescr->content == ct_packetized)
+     && (s->fdescr->u.pes.timed)
+     && (r->fdescr->content == ct_packetized)
+     && (r->fdescr->u.pes.timed)) {
+      t = r->u.d.delta - s->u.d.delta;
+      if ((t < msec2clock (MAX_MSEC_PUSHJTTR))
+       && (t > -msec2clock (MAX_MSEC_PUSHJTTR))) {
+        s->u.d.delta = r->u.d.delta;
+      }
+    }
+    s->u.d.lasttime = s->ctrl.ptr[s->ctrl.out].clockpush + s->u.d.delta;
     warn (LDEB,"Set Trigger",EINP,8,s->u.d.pid,s->u.d.delta);
     s->u.d.trigger = TRUE;
     s->u.d.mention = TRUE;
@@ -179,7 +551,7 @@ static void set_trigger (stream_descr *s,
       i = p->streams;
       while (--i >= 0) {
         if (!p->stream[i]->u.d.trigger) {
-          set_trigger (p->stream[i],now);
+          set_trigger (p->stream[i],now,s);
         }
       }
     }
@@ -237,11 +609,11 @@ static boolean preceding_sequence (stream_descr *d,
 stream_descr *input_available (void)
 {
   int i, s, q;
-  t_msec t, u, now;
+  t_clock t, u, now;
   stream_descr *d, *e;
   ctrl_buffer *c;
   file_descr *f;
-  now = msec_now ();
+  now = clock_now ();
   i = in_files;
   while (--i >= 0) {
     f = inf[i];
@@ -288,9 +660,9 @@ stream_descr *input_available (void)
         /* || (list_free (d->fdescr->data) < HIGHWATER_IN) */
            || (d->endaction == ENDSTR_CLOSE)
            || (d->endaction == ENDSTR_KILL)
-           || ((now - d->ctrl.ptr[d->ctrl.out].msecread)
-                 >= trigger_msec_input)) {
-            set_trigger (d,now);
+           || ((now - d->ctrl.ptr[d->ctrl.out].clockread)
+                 >= msec2clock (trigger_msec_input))) {
+            set_trigger (d,now,NULL);
           }
         }
       }
@@ -305,15 +677,15 @@ stream_descr *input_available (void)
       if (!list_empty (e->ctrl)) {
         warn (LDEB,"Available",EINP,3,2,i);
         c = &(e->ctrl.ptr[e->ctrl.out]);
-        t = c->msecpush + e->u.d.delta;
+        t = c->clockpush + e->u.d.delta;
         if (t - e->u.d.lasttime < 0) {
           warn (LWAR,"Time Decrease",EINP,3,3,t - e->u.d.lasttime);
           clear_trigger (e);
         } else {
           e->u.d.lasttime = t; 
           t -= now;
-          if ((t > MAX_MSEC_PUSHJTTR)
-           || (t < -MAX_MSEC_PUSHJTTR)) {
+          if ((t > msec2clock (MAX_MSEC_PUSHJTTR))
+           || (t < -msec2clock (MAX_MSEC_PUSHJTTR))) {
             warn (LWAR,"Time Jumpness",EINP,3,4,t);
             clear_trigger (e);
           } else {
@@ -382,6 +754,414 @@ char *input_filerefername (int filerefnum)
   return (NULL);
 }
 
+/* Open a network input. The name is udp://[@][<host>]:<port> or the same
+ * with rtp:// instead. If host is a multicast group, the group is joined,
+ * otherwise it names the local address to bind to. IPv6 addresses are
+ * given in brackets.
+ * Precondition: f!=NULL, name!=NULL
+ * Return: socket handle if successful, -1 otherwise
+ */
+static int input_netopen (file_descr *f,
+    char *name,
+    boolean rtp)
+{
+  struct addrinfo hints, *ai;
+  char host[256];
+  char *h, *p;
+  int s, l, r, on;
+  h = strstr (name,"://") + 3;
+  if (*h == '@') {
+    h += 1;
+  }
+  if (*h == '[') {
+    h += 1;
+    p = strchr (h,']');
+    l = (p != NULL) ? (p - h) : 0;
+    p = (p != NULL) ? p + 1 : NULL;
+  } else {
+    p = strrchr (h,':');
+    l = (p != NULL) ? (p - h) : 0;
+  }
+  if ((p == NULL)
+   || (*p != ':')
+   || (l >= sizeof (host))) {
+    warn (LERR,"Net address",EINP,17,1,0);
+    return (-1);
+  }
+  memcpy (host,h,l);
+  host[l] = 0;
+  memset (&hints,0,sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((r = getaddrinfo ((l > 0) ? host : NULL,p + 1,&hints,&ai)) != 0) {
+    warn (LERR,(char *)gai_strerror (r),EINP,17,2,r);
+    return (-1);
+  }
+  if ((f->net = malloc (sizeof (net_descr))) == NULL) {
+    warn (LERR,"Alloc fail",EINP,17,3,0);
+    freeaddrinfo (ai);
+    return (-1);
+  }
+  memset (f->net,0,sizeof (net_descr));
+  f->net->rtp = rtp;
+  if ((s = socket (ai->ai_family,SOCK_DGRAM,0)) >= 0) {
+    on = 1;
+    setsockopt (s,SOL_SOCKET,SO_REUSEADDR,&on,sizeof (on));
+    setsockopt (s,SOL_SOCKET,SO_TIMESTAMPNS,&on,sizeof (on));
+    on = NET_RCVBUF;
+    setsockopt (s,SOL_SOCKET,SO_RCVBUF,&on,sizeof (on));
+    r = bind (s,ai->ai_addr,ai->ai_addrlen);
+    if ((r == 0)
+     && (ai->ai_family == AF_INET)
+     && IN_MULTICAST (ntohl (
+          ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr))) {
+      struct ip_mreq m;
+      m.imr_multiaddr = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+      m.imr_interface.s_addr = htonl (INADDR_ANY);
+      r = setsockopt (s,IPPROTO_IP,IP_ADD_MEMBERSHIP,&m,sizeof (m));
+    } else if ((r == 0)
+     && (ai->ai_family == AF_INET6)
+     && IN6_IS_ADDR_MULTICAST (
+          &((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr)) {
+      struct ipv6_mreq m;
+      m.ipv6mr_multiaddr = ((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr;
+      m.ipv6mr_interface = 0;
+      r = setsockopt (s,IPPROTO_IPV6,IPV6_JOIN_GROUP,&m,sizeof (m));
+    }
+    if ((r == 0)
+     && (fcntl (s,F_SETFL,fcntl (s,F_GETFL) | O_NONBLOCK) == 0)) {
+      freeaddrinfo (ai);
+      return (s);
+    }
+    warn (LERR,"Net bind",EINP,17,4,errno);
+    close (s);
+  } else {
+    warn (LERR,"Net socket",EINP,17,5,errno);
+  }
+  freeaddrinfo (ai);
+  free (f->net);
+  f->net = NULL;
+  return (-1);
+}
+
+/* Open an input file, or a network input if the name says so.
+ * Precondition: f!=NULL, f->net==NULL, name!=NULL
+ * Return: handle if successful, -1 otherwise
+ */
+static int input_open (file_descr *f,
+    char *name)
+{
+  if (!strncmp (name,"udp://",6)) {
+    return (input_netopen (f,name,FALSE));
+  } else if (!strncmp (name,"rtp://",6)) {
+    return (input_netopen (f,name,TRUE));
+  }
+  return (open (name,O_RDONLY|O_NONBLOCK));
+}
+
+/* Release the network part of a file, reporting the reception quality.
+ * Precondition: f!=NULL
+ */
+static void input_netclose (file_descr *f)
+{
+  net_descr *n = f->net;
+  if (n != NULL) {
+    warn (LIMP,"Net datagrams",EINP,17,6,n->datagrams);
+    if ((n->lost | n->reordered | n->late | n->damaged) != 0) {
+      warn (LWAR,"Net lost",EINP,17,7,n->lost);
+      warn (LWAR,"Net reordered",EINP,17,8,n->reordered);
+      warn (LWAR,"Net late",EINP,17,9,n->late);
+      warn (LWAR,"Net damaged",EINP,17,10,n->damaged);
+    }
+    free (n);
+    f->net = NULL;
+  }
+}
+
+/* Store a datagram payload into the raw buffer, behind the stored bytes
+ * not yet accounted for in f->data.in, and note its arrival time.
+ * Precondition: f!=NULL, f->net!=NULL, enough space in f->data
+ */
+static void input_netstore (file_descr *f,
+    byte *d,
+    int len,
+    t_clock arrival,
+    int *stored)
+{
+  net_descr *n = f->net;
+  int p, c, i;
+  p = (f->data.in + *stored) & f->data.mask;
+  if (d != &f->data.ptr[p]) {
+    c = mmin (len,f->data.mask + 1 - p);
+    memmove (&f->data.ptr[p],d,c);
+    memcpy (&f->data.ptr[0],d + c,len - c);
+  }
+  i = (n->arrin + 1) & (MAX_NET_ARRIVAL - 1);
+  if (i != n->arrout) {
+    n->arrival[n->arrin].offset = n->received;
+    n->arrival[n->arrin].arrival = arrival;
+    n->arrin = i;
+  }
+  n->received += len;
+  *stored += len;
+}
+
+/* Move held back RTP datagrams that are next in sequence into the raw
+ * buffer, as far as the space allows. If the oldest held datagram waits
+ * too long, or force is set, the missing ones before it are given up.
+ * Precondition: f!=NULL, f->net!=NULL
+ */
+static void input_netflush (file_descr *f,
+    int space,
+    int *stored,
+    t_clock now,
+    boolean force)
+{
+  net_descr *n = f->net;
+  int i, k;
+  while (n->held > 0) {
+    i = n->expect % MAX_NET_REORDER;
+    if (n->heldlen[i] > 0) {
+      if (*stored + n->heldlen[i] > space) {
+        return;
+      }
+      input_netstore (f,n->helddata[i],n->heldlen[i],n->heldarrival[i],stored);
+      n->heldlen[i] = 0;
+      n->held -= 1;
+      n->expect += 1;
+    } else {
+      k = 1;
+      while (n->heldlen[(n->expect + k) % MAX_NET_REORDER] == 0) {
+        k += 1;
+      }
+      i = (n->expect + k) % MAX_NET_REORDER;
+      if (!force
+       && (n->heldarrival[i] + msec2clock (MAX_MSEC_REORDER) > now)) {
+        return;
+      }
+      n->lost += k;
+      n->expect += k;
+    }
+  }
+}
+
+/* Accept an RTP datagram payload. It is stored if it is next in sequence,
+ * held back if it is ahead of missing ones, and dropped if it is behind.
+ * The raw buffer may be written up to space bytes behind f->data.in,
+ * the last MAX_DGRAM_IN of these may hold the payload itself.
+ * Precondition: f!=NULL, f->net!=NULL
+ */
+static void input_netrtp (file_descr *f,
+    byte *d,
+    int len,
+    uint16_t seq,
+    t_clock arrival,
+    int space,
+    int *stored)
+{
+  net_descr *n = f->net;
+  int16_t ahead;
+  int i;
+  if (!n->started) {
+    n->expect = seq;
+    n->started = TRUE;
+  }
+  ahead = seq - n->expect;
+  if (ahead < 0) {
+    n->late += 1;
+    return;
+  }
+  while (ahead >= MAX_NET_REORDER) {
+    if (n->held > 0) {
+      input_netflush (f,space - MAX_DGRAM_IN,stored,arrival,TRUE);
+      if (n->held > 0) {
+        break;
+      }
+    } else {
+      n->lost += ahead;
+      n->expect = seq;
+    }
+    ahead = seq - n->expect;
+  }
+  i = seq % MAX_NET_REORDER;
+  if ((ahead == 0)
+   && (n->held == 0)
+   && (*stored + len <= space)) {
+    input_netstore (f,d,len,arrival,stored);
+    n->expect += 1;
+  } else if ((ahead >= MAX_NET_REORDER)
+   || (n->heldlen[i] != 0)) {
+    n->late += 1;
+  } else {
+    memcpy (n->helddata[i],d,len);
+    n->heldlen[i] = len;
+    n->heldarrival[i] = arrival;
+    n->held += 1;
+    if (ahead > 0) {
+      n->reordered += 1;
+    } else {
+      input_netflush (f,space,stored,arrival,FALSE);
+    }
+  }
+}
+
+/* Receive datagrams from a network input into the raw buffer, many of them
+ * with a single operation and straight into place as far as possible.
+ * RTP headers are stripped, the payload is put in sequence order.
+ * The arrival time of each datagram is kept for input_clockread,
+ * for RTP derived from the time stamp to smooth the network jitter.
+ * Precondition: f!=NULL, f->net!=NULL
+ * Return: number of bytes stored, -1 if none
+ */
+static int input_netread (file_descr *f)
+{
+  static struct mmsghdr msg[MAX_DGRAM_BURST];
+  static struct iovec iov[MAX_DGRAM_BURST][2];
+  static byte rtp[MAX_DGRAM_BURST][RTP_HEADER_SIZE];
+  static byte bounce[MAX_DGRAM_IN];
+  static union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE (sizeof (struct timespec))];
+  } control[MAX_DGRAM_BURST];
+  net_descr *n = f->net;
+  struct cmsghdr *cm;
+  struct timespec rt, *ts;
+  t_clock now, arrival, c;
+  int space, m, i, k, r, h, len, stored;
+  byte *d;
+  space = list_free (f->data);
+  m = mmin (list_freeinend (f->data),space) / MAX_DGRAM_IN;
+  m = mmin (m,MAX_DGRAM_BURST);
+  if (m == 0) {
+    if (space < MAX_DGRAM_IN) {
+      return (-1);
+    }
+    m = 1;
+  }
+  for (i = 0; i < m; i++) {
+    k = 0;
+    if (n->rtp) {
+      iov[i][k].iov_base = rtp[i];
+      iov[i][k++].iov_len = RTP_HEADER_SIZE;
+    }
+    iov[i][k].iov_base = (list_freeinend (f->data) < MAX_DGRAM_IN) ? bounce
+        : &f->data.ptr[f->data.in + i * MAX_DGRAM_IN];
+    iov[i][k++].iov_len = MAX_DGRAM_IN;
+    memset (&msg[i],0,sizeof (msg[i]));
+    msg[i].msg_hdr.msg_iov = iov[i];
+    msg[i].msg_hdr.msg_iovlen = k;
+    msg[i].msg_hdr.msg_control = &control[i];
+    msg[i].msg_hdr.msg_controllen = sizeof (control[i]);
+  }
+  r = recvmmsg (f->handle,msg,m,MSG_DONTWAIT,NULL);
+  if (r < m) {
+    dispatch_drained (f->handle,POLLIN);
+  }
+  if (r <= 0) {
+    if ((r < 0)
+     && (errno != EAGAIN)
+     && (errno != EINTR)) {
+      warn (LWAR,"Net receive",EINP,17,11,errno);
+    }
+    return (-1);
+  }
+  now = clock_now ();
+  clock_gettime (CLOCK_REALTIME,&rt);
+  stored = 0;
+  for (i = 0; i < r; i++) {
+    n->datagrams += 1;
+    arrival = now;
+    cm = CMSG_FIRSTHDR (&msg[i].msg_hdr);
+    while (cm != NULL) {
+      if ((cm->cmsg_level == SOL_SOCKET)
+       && (cm->cmsg_type == SCM_TIMESTAMPNS)) {
+        ts = (struct timespec *)CMSG_DATA (cm);
+        c = (t_clock)(rt.tv_sec - ts->tv_sec) * CLOCK_HZ
+          + ((t_clock)(rt.tv_nsec - ts->tv_nsec) * (CLOCK_HZ / 1000000)) / 1000;
+        if ((c >= 0)
+         && (c < CLOCK_HZ)) {
+          arrival = now - c;
+        }
+      }
+      cm = CMSG_NXTHDR (&msg[i].msg_hdr,cm);
+    }
+    d = iov[i][n->rtp ? 1 : 0].iov_base;
+    len = msg[i].msg_len;
+    if (msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+      n->damaged += 1;
+      continue;
+    }
+    if (n->rtp) {
+      byte *p = rtp[i];
+      uint32_t stamp;
+      len -= RTP_HEADER_SIZE;
+      if ((len < 0)
+       || ((p[0] & 0xC0) != RTP_VERSION)) {
+        n->damaged += 1;
+        continue;
+      }
+      h = 4 * (p[0] & 0x0F);
+      if ((p[0] & 0x10)
+       && (h + 4 <= len)) {
+        h += 4 + 4 * ((d[h+2] << 8) | d[h+3]);
+      }
+      if ((p[0] & 0x20)
+       && (len > 0)) {
+        len -= d[len-1];
+      }
+      if (h > len) {
+        n->damaged += 1;
+        continue;
+      }
+      stamp = (p[4] << 24) | (p[5] << 16) | (p[6] << 8) | p[7];
+      if (n->started) {
+        n->rtpclock += (t_clock)(int32_t)(stamp - n->stamp) * 300;
+      }
+      n->stamp = stamp;
+      c = arrival - n->rtpclock;
+      if (!n->started
+       || (c < n->transit)
+       || (c - n->transit > CLOCK_HZ)) {
+        n->transit = c;
+      } else {
+        n->transit += (c - n->transit) >> 10;
+      }
+      input_netrtp (f,d + h,len - h,(p[2] << 8) | p[3],
+          n->rtpclock + n->transit,(i + 1) * MAX_DGRAM_IN,&stored);
+    } else {
+      input_netstore (f,d,len,arrival,&stored);
+    }
+  }
+  if (n->held > 0) {
+    input_netflush (f,space,&stored,now,FALSE);
+  }
+  return ((stored > 0) ? stored : -1);
+}
+
+/* Determine the time at which the data next to be split was read.
+ * For network inputs, this is the arrival time of the datagram that
+ * carried the byte at f->total, otherwise the present time.
+ * Precondition: f!=NULL
+ * Return: read time
+ */
+t_clock input_clockread (file_descr *f)
+{
+  net_descr *n = f->net;
+  int i;
+  if ((n == NULL)
+   || (n->arrout == n->arrin)) {
+    return (clock_now ());
+  }
+  i = (n->arrout + 1) & (MAX_NET_ARRIVAL - 1);
+  while ((i != n->arrin)
+      && ((int32_t)(n->arrival[i].offset - (uint32_t)f->total) <= 0)) {
+    n->arrout = i;
+    i = (i + 1) & (MAX_NET_ARRIVAL - 1);
+  }
+  return (n->arrival[n->arrout].arrival);
+}
+
 /* Open a file. Allocate and initialize it.
  * Precondition: name!=NULL
  * Return: file, if successful, NULL otherwise
@@ -396,7 +1176,7 @@ file_descr* input_openfile (char *name,
   struct stat stat;
   warn (LIMP,"Create file",EINP,4,automatic,content);
   warn (LIMP,name,EINP,4,4,programnb);
-  if (in_files < MAX_INFILE) {
+  if (table_reserve (&inf,&inf_alloc,in_files + 1,sizeof (*inf))) {
     switch (content) {
       case ct_packetized:
         f = unionalloc (file_descr,pes);
@@ -415,11 +1195,20 @@ file_descr* input_openfile (char *name,
     if (f != NULL) {
       if ((f->name = malloc (strlen(name) + 1)) != NULL) {
         if (list_create (f->data,MAX_DATA_RAWB)) {
-          if ((f->handle = open (name,O_RDONLY|O_NONBLOCK)) >= 0) {
-            if (fstat (f->handle,&stat) == 0) {
+          f->net = NULL;
+          f->mmapped = FALSE;
+          if ((f->handle = input_open (f,name)) >= 0) {
+            if ((fstat (f->handle,&stat) == 0)
+             && table_reserve (&inf_handle,&inf_handles,
+                  f->handle + 1,sizeof (*inf_handle))) {
               f->st_mode = stat.st_mode;
+              f->mapchunk = FALSE;
+              f->mapoffset = 0;
+              f->threaded = FALSE;
               if (!S_ISREG (f->st_mode)) {
                 timed_io = TRUE;
+              } else {
+                input_mapinit (f);
               }
               strcpy (f->name,name);
               f->filerefnum = filerefnum;
@@ -437,16 +1226,23 @@ file_descr* input_openfile (char *name,
               switch (content) {
                 case ct_packetized:
                   f->u.pes.stream = NULL;
+                  f->u.pes.timed = FALSE;
+                  f->u.pes.conv.base = 0;
+                  f->u.pes.conv.clock = 0;
                   in_openfiles[content] += 1;
                   inf[in_files++] = f;
+                  input_indexfile (f);
                   return (f);
                   break;
                 case ct_program:
+                  memset (&f->u.ps.ph,0,sizeof(f->u.ps.ph));
+                  memset (&f->u.ps.sh,0,sizeof(f->u.ps.sh));
                   memset (f->u.ps.stream,0,sizeof(f->u.ps.stream));
                   f->u.ps.stream[0] = input_openstream (f,0,0,0,sd_map,NULL);
                   if (f->u.ps.stream[0] != NULL) {
                     in_openfiles[content] += 1;
                     inf[in_files++] = f;
+                    input_indexfile (f);
                     return (f);
                   }
                   break;
@@ -456,12 +1252,20 @@ file_descr* input_openfile (char *name,
                   f->u.ts.pat = NULL;
                   f->u.ts.newpat = NULL;
                   f->u.ts.tsauto = NULL;
+                  f->u.ts.autopass = PASS_NONE;
                   f->u.ts.tssi = NULL;
+                  f->u.ts.filterpos = -1;
+                  f->u.ts.stride = 0;
+                  f->u.ts.synclocks = 0;
+                  f->u.ts.syncunlocks = 0;
+                  f->u.ts.arrivalvalid = FALSE;
                   memset (f->u.ts.stream,0,sizeof(f->u.ts.stream));
+                  ts_file_pidchanged (f);
                   ts_file_stream (f,0) = input_openstream (f,0,0,0,sd_map,NULL);
                   if (ts_file_stream (f,0) != NULL) {
                     in_openfiles[content] += 1;
                     inf[in_files++] = f;
+                    input_indexfile (f);
                     return (f);
                   }
                   break;
@@ -472,10 +1276,15 @@ file_descr* input_openfile (char *name,
               warn (LERR,"FStat fail",EINP,4,6,0);
             }
             close (f->handle);
+            input_netclose (f);
           } else {
             warn (LERR,"Open fail",EINP,4,5,f->handle);
           }
-          list_release (f->data);
+          if (f->mmapped) {
+            munmap (f->data.ptr,f->data.mask + 1);
+          } else {
+            list_release (f->data);
+          }
         }
         free (f->name);
       } else {
@@ -486,7 +1295,7 @@ file_descr* input_openfile (char *name,
       warn (LERR,"Alloc fail",EINP,4,2,in_files);
     }
   } else {
-    warn (LERR,"Max file open",EINP,4,3,in_files);
+    warn (LERR,"Alloc fail",EINP,4,3,in_files);
   }
   return (NULL);
 }
@@ -498,12 +1307,13 @@ file_descr* input_openfile (char *name,
  */
 file_descr* input_existfile (char *name)
 {
-  int i;
-  i = in_files;
-  while (--i >= 0) {
-    if (!strcmp (name,inf[i]->name)) {
-      return (inf[i]);
+  file_descr *f;
+  f = inf_name[input_namehash (name)];
+  while (f != NULL) {
+    if (!strcmp (name,f->name)) {
+      return (f);
     }
+    f = f->hash_name;
   }
   return (NULL);
 }
@@ -523,8 +1333,11 @@ static void input_endfile (file_descr *f)
     }
   }
   if (f->handle >= 0) {
+    input_unindexfile (f);
+    dispatch_forget (f->handle);
     close (f->handle);
     f->handle = -1;
+    input_indexfile (f);
   }
   input_closefileifunused (f);
 }
@@ -535,10 +1348,18 @@ static void input_endfile (file_descr *f)
 static void input_closefile (file_descr *f)
 {
   int i;
+  input_stopthread (f);
+  input_unindexfile (f);
   if (f->handle >= 0) {
+    dispatch_forget (f->handle);
     close (f->handle);
   }
-  list_release (f->data);
+  input_netclose (f);
+  if (f->mmapped) {
+    munmap (f->data.ptr,f->data.mask + 1);
+  } else {
+    list_release (f->data);
+  }
   free (f->name);
   switch (f->content) {
     case ct_transport:
@@ -631,7 +1452,8 @@ void input_closefileifunused (file_descr *f)
 boolean input_addprog (stream_descr *s,
     prog_descr *p)
 {
-  if (s->u.d.progs < MAX_PRGFORSTR) {
+  if (table_reserve (&s->u.d.pdescr,&s->u.d.pdescr_alloc,
+        s->u.d.progs + 1,sizeof (*s->u.d.pdescr))) {
     s->u.d.pdescr[s->u.d.progs++] = p;
     warn (LDEB,"Add prog",EINP,10,2,s->u.d.progs);
     return (TRUE);
@@ -661,7 +1483,26 @@ boolean input_delprog (stream_descr *s,
   return (FALSE);
 }
 
+/* Determine the size of a stream descriptor, which depends on the
+ * kind of data the stream carries.
+ * Return: size in bytes, 0 if unknown
+ */
+static int input_streamsize (streamdata_type streamdata)
+{
+  switch (streamdata) {
+    case sd_data:
+      return (unionsize (stream_descr,d));
+    case sd_map:
+      return (unionsize (stream_descr,m));
+    case sd_unparsedsi:
+      return (unionsize (stream_descr,usi));
+    default:
+      return (0);
+  }
+}
+
 /* Open a stream in a file. Allocate and initialize it.
+ * Descriptor and ring buffers are taken from the pool.
  * sourceid is the stream's ID in the source file.
  * streamid is the PES packet stream id.
  * streamtype is the stream type according to ISO 13818-1 table 2-29.
@@ -678,25 +1519,19 @@ stream_descr *input_openstream (file_descr *f,
     stream_descr *mapstream)
 {
   stream_descr *s;
+  int n;
   warn (LIMP,"Open stream",EINP,5,sourceid,streamid);
-  if (in_streams < MAX_INSTREAM) {
-    switch (streamdata) {
-      case sd_data:
-        s = unionalloc (stream_descr,d);
-        break;
-      case sd_map:
-        s = unionalloc (stream_descr,m);
-        break;
-      case sd_unparsedsi:
-        s = unionalloc (stream_descr,usi);
-        break;
-      default:
-        s = NULL;
-        break;
+  if (table_reserve (&ins,&ins_alloc,in_streams + 1,sizeof (*ins))) {
+    n = input_streamsize (streamdata);
+    if ((n > 0)
+     && ((s = pool_alloc (n)) != NULL)) {
+      s->autodescr = s->manudescr = NULL;
+    } else {
+      s = NULL;
     }
     if ((s != NULL)
-     && ((s->autodescr = malloc (sizeof (descr_descr))) != NULL)
-     && ((s->manudescr = malloc (sizeof (descr_descr))) != NULL)) {
+     && ((s->autodescr = pool_alloc (sizeof (descr_descr))) != NULL)
+     && ((s->manudescr = pool_alloc (sizeof (descr_descr))) != NULL)) {
       if (list_create (s->ctrl,MAX_CTRL_INB)) {
         if ((streamdata == sd_map) ?
             list_create (s->data,MAX_DATA_INBPSI) :
@@ -714,16 +1549,24 @@ stream_descr *input_openstream (file_descr *f,
               s->u.d.mention = FALSE;
               s->u.d.has_clockref = FALSE;
               s->u.d.has_opcr = FALSE;
-              s->u.d.conv.base = 0;
-              s->u.d.conv.msec = 0;
               s->u.d.progs = 0;
+              s->u.d.pdescr_alloc = 0;
+              s->u.d.pdescr = NULL;
+              s->u.d.outrefs = 0;
+              s->u.d.outdone = 0;
+              s->u.d.maxlength = 0;
+              s->u.d.payload = 0;
+              s->u.d.packets = 0;
+              s->u.d.ratevalid = FALSE;
+              s->u.d.pass = PASS_NONE;
               f->openstreams[streamdata] += 1;
               in_openstreams[streamdata] += 1;
               break;
             case sd_map:
-              s->u.m.msectime = 0;
+              s->u.m.clocktime = 0;
+              s->u.m.pcrarrival = -1;
               s->u.m.conv.base = 0;
-              s->u.m.conv.msec = 0;
+              s->u.m.conv.clock = 0;
               s->u.m.psi_length = 0;
               f->openstreams[streamdata] += 1;
               in_openstreams[streamdata] += 1;
@@ -747,17 +1590,24 @@ stream_descr *input_openstream (file_descr *f,
           s->endaction = ENDSTR_WAIT;
           clear_descrdescr (s->autodescr);
           clear_descrdescr (s->manudescr);
+          if (f->content == ct_transport) {
+            ts_file_pidchanged (f);
+          }
           ins[in_streams++] = s;
           return (s);
         }
         list_release (s->ctrl);
       }
-      free (s);
     } else {
       warn (LERR,"Alloc fail",EINP,5,1,in_streams);
     }
+    if (s != NULL) {
+      pool_free (s->manudescr,sizeof (descr_descr));
+      pool_free (s->autodescr,sizeof (descr_descr));
+      pool_free (s,n);
+    }
   } else {
-    warn (LERR,"Max stream open",EINP,5,2,in_streams);
+    warn (LERR,"Alloc fail",EINP,5,2,in_streams);
   }
   return (NULL);
 }
@@ -812,7 +1662,8 @@ void input_endstreamkill (stream_descr *s)
 }
 
 /* Close a stream.
- * Release all structures. If this is the only data stream related to the
+ * Release all structures, handing descriptor and rings back to the pool.
+ * If this is the only data stream related to the
  * corresponding map stream, close the map stream, too.
  * Precondition: s!=NULL
  */
@@ -829,6 +1680,7 @@ void input_closestream (stream_descr *s)
       break;
     case ct_transport:
       ts_file_stream (s->fdescr,s->sourceid) = NULL;
+      ts_file_pidchanged (s->fdescr);
       break;
     default:
       warn (LERR,"Unknown contents",EINP,6,2,s->fdescr->content);
@@ -868,11 +1720,200 @@ void input_closestream (stream_descr *s)
   if (i < 0) {
     warn (LERR,"Close lost stream",EINP,6,1,in_streams);
   }
+  if (s->streamdata == sd_data) {
+    output_materialize (s);
+    free (s->u.d.pdescr);
+  }
+  list_release (s->data);
+  list_release (s->ctrl);
+  pool_free (s->manudescr,sizeof (descr_descr));
+  pool_free (s->autodescr,sizeof (descr_descr));
+  pool_free (s,input_streamsize (s->streamdata));
+}
+
+/* Account for a PES packet (or TS packet to pass) split into a data
+ * stream, to measure the stream's rate, see input_adaptrings.
+ * Precondition: s!=NULL, s->streamdata==sd_data
+ */
+void input_splitdone (stream_descr *s,
+    int length)
+{
+  s->u.d.payload += length;
+  s->u.d.packets += 1;
+  if (s->u.d.maxlength < length) {
+    s->u.d.maxlength = length;
+  }
+}
+
+/* Note a PES packet announced for a data stream, that finds too little
+ * space in the data ring, so that input_adaptrings grows the ring at
+ * once, if it is too small to ever take the packet.
+ * Precondition: s!=NULL, s->streamdata==sd_data
+ */
+void input_splitwanted (stream_descr *s,
+    int length)
+{
+  if (s->u.d.maxlength < length) {
+    s->u.d.maxlength = length;
+  }
+}
+
+/* Move the contents of the rings of a data stream to new rings of the
+ * given sizes. The complete packets and, with TS, the one being
+ * acquired, are packed to the start of the new data ring, and their
+ * ctrl entries to the start of the new ctrl ring. The rest of the PES
+ * being acquired must fit behind, as it is copied without wrap around.
+ * A PES header still under evaluation may lie behind the data in,
+ * see ts_data_stream, so it is copied in any case.
+ * Payload referenced by the output is copied there beforehand.
+ * Precondition: s!=NULL, s->streamdata==sd_data, sizes are powers of 2
+ * Return: TRUE if successful, FALSE if the contents do not fit
+ */
+static boolean input_resizerings (stream_descr *s,
+    int datasize,
+    int ctrlsize)
+{
+  refr_data d;
+  refr_ctrl c;
+  ctrl_buffer *b;
+  int i, n, l;
+  boolean partial;
+  b = &s->ctrl.ptr[s->ctrl.in];
+  partial = (s->fdescr->content == ct_transport)
+         && (s->u.d.pass == PASS_NONE)
+         && (b->length != 0);
+  n = partial ? ((s->data.in - b->index) & s->data.mask) : 0;
+  i = s->ctrl.out;
+  while (i != s->ctrl.in) {
+    n += s->ctrl.ptr[i].length;
+    list_incr (i,s->ctrl,1);
+  }
+  if ((n >= (datasize / 2))
+   || (partial
+    && (b->length > 0)
+    && ((n + b->length) >= datasize))
+   || (list_size (s->ctrl) >= (ctrlsize / 2))) {
+    warn (LDEB,"Resize rings",EINP,18,1,n);
+    return (FALSE);
+  }
+  output_materialize (s);
+  if (!list_create (d,datasize)) {
+    return (FALSE);
+  }
+  if (!list_create (c,ctrlsize)) {
+    list_release (d);
+    return (FALSE);
+  }
+  n = 0;
+  i = s->ctrl.out;
+  while (TRUE) {
+    b = &s->ctrl.ptr[i];
+    if (i == s->ctrl.in) {
+      if (partial) {
+        l = (s->data.in - b->index) & s->data.mask;
+        memcpy (&d.ptr[n],&s->data.ptr[b->index],
+            ((b->length == -2) && (l < PES_HEADER_SIZE)) ? PES_HEADER_SIZE : l);
+        b->index = n;
+        n += l;
+      }
+      c.ptr[c.in] = *b;
+      break;
+    }
+    memcpy (&d.ptr[n],&s->data.ptr[b->index],b->length);
+    b->index = n;
+    n += b->length;
+    c.ptr[c.in] = *b;
+    list_incr (c.in,c,1);
+    list_incr (i,s->ctrl,1);
+  }
+  d.in = n;
+  warn (LINF,"Resize rings",EINP,18,s->u.d.pid,datasize);
+  if (d.mask < s->data.mask) {
+    list_trim (s->data);
+  }
+  if (c.mask < s->ctrl.mask) {
+    list_trim (s->ctrl);
+  }
   list_release (s->data);
   list_release (s->ctrl);
-  free (s->manudescr);
-  free (s->autodescr);
-  free (s);
+  s->data = d;
+  s->ctrl = c;
+  s->u.d.outdone = s->data.out;
+  return (TRUE);
+}
+
+/* Adapt the ring sizes of a data stream to its rate. The rate is
+ * measured in push time over MSEC_ADAPT_INB. The data ring is sized to
+ * hold twice what arrives while waiting for the input trigger and the
+ * output, and four of the largest packets. The ctrl ring is sized alike.
+ * Rings grow at once, but shrink only if four times too large. A data
+ * ring too small for four of the largest packets announced grows without
+ * waiting for the measurement, as the splitter is stuck meanwhile. If the
+ * contents do not fit yet, try again with the next measurement.
+ * Precondition: s!=NULL, s->streamdata==sd_data
+ */
+static void input_adaptrings (stream_descr *s)
+{
+  t_clock t;
+  int64_t b, p;
+  int datasize, ctrlsize;
+  if (((s->data.mask + 1) < (4 * s->u.d.maxlength))
+   && ((s->data.mask + 1) < MAX_DATA_INBADAPT)) {
+    datasize = s->data.mask + 1;
+    while ((datasize < (4 * s->u.d.maxlength))
+        && (datasize < MAX_DATA_INBADAPT)) {
+      datasize <<= 1;
+    }
+    input_resizerings (s,datasize,s->ctrl.mask + 1);
+  }
+  if (list_empty (s->ctrl)) {
+    return;
+  }
+  t = s->ctrl.ptr[(s->ctrl.in - 1) & s->ctrl.mask].clockpush;
+  if (s->u.d.ratevalid) {
+    t -= s->u.d.ratetime;
+    if ((t >= 0)
+     && (t < msec2clock (4 * MSEC_ADAPT_INB))) {
+      if (t < msec2clock (MSEC_ADAPT_INB)) {
+        return;
+      }
+      b = (int64_t)s->u.d.payload
+        * (trigger_msec_input + MAX_MSEC_OUTDELAY) * 2
+        * CLOCK_HZ / 1000 / t;
+      p = (int64_t)s->u.d.packets
+        * (trigger_msec_input + MAX_MSEC_OUTDELAY) * 2
+        * CLOCK_HZ / 1000 / t;
+      if (b < (4 * s->u.d.maxlength)) {
+        b = 4 * s->u.d.maxlength;
+      }
+      datasize = MIN_DATA_INBADAPT;
+      while ((datasize < b)
+          && (datasize < MAX_DATA_INBADAPT)) {
+        datasize <<= 1;
+      }
+      ctrlsize = MIN_CTRL_INBADAPT;
+      while ((ctrlsize < p)
+          && (ctrlsize < MAX_CTRL_INBADAPT)) {
+        ctrlsize <<= 1;
+      }
+      if ((datasize < (s->data.mask + 1))
+       && ((datasize * 4) > (s->data.mask + 1))) {
+        datasize = s->data.mask + 1;
+      }
+      if ((ctrlsize < (s->ctrl.mask + 1))
+       && ((ctrlsize * 4) > (s->ctrl.mask + 1))) {
+        ctrlsize = s->ctrl.mask + 1;
+      }
+      if ((datasize != (s->data.mask + 1))
+       || (ctrlsize != (s->ctrl.mask + 1))) {
+        input_resizerings (s,datasize,ctrlsize);
+      }
+    }
+  }
+  s->u.d.ratetime = s->ctrl.ptr[(s->ctrl.in - 1) & s->ctrl.mask].clockpush;
+  s->u.d.ratevalid = TRUE;
+  s->u.d.payload = 0;
+  s->u.d.packets = 0;
 }
 
 /* Split data from raw input buffers to PES data stream buffers.
@@ -883,6 +1924,9 @@ boolean split_something (void)
   int i;
   boolean r = FALSE;
   warn (LDEB,"Split some",EINP,7,0,in_files);
+  if (split_threads) {
+    r = input_splitparallel ();
+  }
   i = in_files;
   while (--i >= 0) {
     switch (inf[i]->content) {
@@ -907,6 +1951,12 @@ boolean split_something (void)
         break;
     }
   }
+  i = in_streams;
+  while (--i >= 0) {
+    if (ins[i]->streamdata == sd_data) {
+      input_adaptrings (ins[i]);
+    }
+  }
   return (r);
 }
 
@@ -932,18 +1982,35 @@ int input_tssiinafilerange (int pid)
   return (-1);
 }
 
-/* Determine the appropriate file for a given handle
- * Return: file, if found, NULL otherwise
+/* Sum up the TS sync lock and unlock events of all files since the
+ * last call, and reset the counters.
+ * Precondition: locks!=NULL, unlocks!=NULL
  */
-file_descr *input_filehandle (int handle)
+void input_syncevents (int *locks,
+    int *unlocks)
 {
   int i;
+  *locks = *unlocks = 0;
   i = in_files;
   while (--i >= 0) {
-    if (inf[i]->handle == handle) {
-      return (inf[i]);
+    if (inf[i]->content == ct_transport) {
+      *locks += inf[i]->u.ts.synclocks;
+      *unlocks += inf[i]->u.ts.syncunlocks;
+      inf[i]->u.ts.synclocks = 0;
+      inf[i]->u.ts.syncunlocks = 0;
     }
   }
+}
+
+/* Determine the appropriate file for a given handle
+ * Return: file, if found, NULL otherwise
+ */
+file_descr *input_filehandle (int handle)
+{
+  if ((handle >= 0)
+   && (handle < inf_handles)) {
+    return (inf_handle[handle]);
+  }
   return (NULL);
 }
 
@@ -955,17 +2022,24 @@ file_descr *input_filehandle (int handle)
 file_descr *input_filereferenced (int filerefnum,
     char *filename)
 {
-  int i;
   file_descr *f;
-  i = in_files;
-  while (--i >= 0) {
-    f = inf[i];
-    if ((filename == NULL)
-        ? (filerefnum == f->filerefnum)
-        : ((!strcmp (filename, f->name))
-        && ((filerefnum < 0)
-         || (filerefnum == f->filerefnum)))) {
-      return (f);
+  if (filename == NULL) {
+    f = inf_refnum[filerefnum & (HASH_SIZE - 1)];
+    while (f != NULL) {
+      if (filerefnum == f->filerefnum) {
+        return (f);
+      }
+      f = f->hash_refnum;
+    }
+  } else {
+    f = inf_name[input_namehash (filename)];
+    while (f != NULL) {
+      if ((!strcmp (filename, f->name))
+       && ((filerefnum < 0)
+        || (filerefnum == f->filerefnum))) {
+        return (f);
+      }
+      f = f->hash_name;
     }
   }
   return (NULL);
@@ -993,22 +2067,40 @@ void input_something (file_descr *f,
   if (f != NULL) {
     if (f->handle >= 0) {
       warn (LDEB,"Something",EINP,0,1,f);
+      l = 0;
       if (readable && !f->stopfile) {
-        l = list_freeinend (f->data);
-        if (l > MAX_READ_IN) {
-          l = MAX_READ_IN;
+        if (f->mmapped && f->mapchunk) {
+          l = input_mapchunk (f);
         }
-        m = list_free (f->data);
-        if (l > m) {
-          l = m;
+        if (l == 0) {
+          l = list_freeinend (f->data);
+          if (l > MAX_READ_IN) {
+            l = MAX_READ_IN;
+          }
+          m = list_free (f->data);
+          if (l > m) {
+            l = m;
+          }
+          m = l;
+          if (f->net != NULL) {
+            l = input_netread (f);
+          } else {
+            l = read (f->handle,&f->data.ptr[f->data.in],l);
+            if ((l != 0) && (l < m)) {
+              dispatch_drained (f->handle,POLLIN);
+            }
+          }
         }
-        l = read (f->handle,&f->data.ptr[f->data.in],l);
-      } else {
-        l = 0;
       }
       warn (LDEB,"Some Read",EINP,0,2,l);
       if (l > 0) {
         list_incr (f->data.in,f->data,l);
+        f->mapoffset += l;
+        if ((f->content == ct_transport)
+         && (f->net == NULL)
+         && (!f->mmapped)) {
+          split_tsfilter (f);
+        }
       } else if (l == 0) {
         f->stopfile = FALSE;
         if (f->repeatitions != 0) {
@@ -1017,20 +2109,34 @@ void input_something (file_descr *f,
           }
           if (lseek (f->handle,0,SEEK_CUR) > 255) {
             lseek (f->handle,0,SEEK_SET);
+            f->mapoffset = 0;
+            f->mapchunk = f->mmapped;
             warn (LIMP,"End Repeat",EINP,0,4,f);
           } else {
             warn (LWAR,"Repeat fail",EINP,0,5,f);
           }
         } else if (f->append_name != NULL) {
+          input_unindexfile (f);
           free (f->name);
           f->name = f->append_name;
           f->append_name = NULL;
           if (f->append_filerefnum >= 0) {
             f->filerefnum = f->append_filerefnum;
           }
+          dispatch_forget (f->handle);
           close (f->handle);
-          if ((f->handle = open (f->name,O_RDONLY|O_NONBLOCK)) >= 0) {
+          input_netclose (f);
+          if (f->content == ct_transport) {
+            f->u.ts.filterpos = -1;
+            f->u.ts.stride = 0;
+            f->u.ts.arrivalvalid = FALSE;
+          }
+          if (((f->handle = input_open (f,f->name)) >= 0)
+           && input_indexfile (f)) {
             struct stat stat;
+            if (f->net != NULL) {
+              f->net->received = f->total + list_size (f->data);
+            }
             if (fstat (f->handle,&stat) == 0) {
               f->st_mode = stat.st_mode;
               if (!S_ISREG (f->st_mode)) {
@@ -1043,6 +2149,8 @@ void input_something (file_descr *f,
               } else {
                 f->repeatitions = f->append_repeatitions;
               }
+              f->mapoffset = 0;
+              f->mapchunk = f->mmapped && S_ISREG (f->st_mode);
               configuration_changed = TRUE;
               warn (LIMP,"End Append",EINP,0,f->repeatitions,f);
             } else {
@@ -24,7 +24,7 @@ boolean input_expected (void);
 void input_settriggertiming (t_msec time);
 boolean input_acceptable (unsigned int *nfds,
     struct pollfd *ufds,
-    t_msec *timeout,
+    t_clock *timeout,
     boolean outnotfull);
 stream_descr *input_available (void);
 char *input_filerefername (int filerefnum);
@@ -48,12 +48,21 @@ stream_descr *input_openstream (file_descr *f,
 void input_endstream (stream_descr *s);
 void input_endstreamkill (stream_descr *s);
 void input_closestream (stream_descr *s);
+boolean input_setthreads (void);
 boolean split_something (void);
+void input_splitdone (stream_descr *s,
+    int length);
+void input_splitwanted (stream_descr *s,
+    int length);
 int input_tssiinafilerange (int pid);
+void input_syncevents (int *locks,
+    int *unlocks);
+int input_filecount (void);
 file_descr *input_filehandle (int handle);
 file_descr *input_filereferenced (int filerefnum,
     char *filename);
 void input_stopfile (file_descr *f);
+t_clock input_clockread (file_descr *f);
 void input_something (file_descr *f,
     boolean readable);
 
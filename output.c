@@ -25,25 +25,87 @@
  * Besides functions to detect states of the output buffer, and to
  * write data from it, support in filling the output buffer is
  * provided to the splicers.
+ *
+ * The output buffer is shared by all sinks (stdout, files, UDP).
+ * Each sink has its own read position, the buffer is released as
+ * far as the slowest sink has written it. A sink that lags behind
+ * with data that is due may block the others, or drop data, or
+ * be disconnected, depending on its policy.
+ *
+ * A TS packet may be pushed with its payload left in the stream buffer
+ * it is taken from, see output_reference. Only header and adaptation
+ * field are then written into the output buffer, the payload is
+ * gathered from the stream buffer when writing. It is copied into
+ * the output buffer only if the stream needs the space before.
  */
 
+#define _GNU_SOURCE /* sendmmsg */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
 #include "global.h"
 #include "error.h"
 #include "output.h"
+#include "dispatch.h"
+#include "input.h"
+#include "ts.h"
+
+#define DGRAM_SIZE (MAX_DGRAM_PACKETS * TS_PACKET_SIZE)
+
+/* An output sink, reading from the shared output buffer:
+ */
+typedef struct {
+  int handle;
+  char *name;
+  sink_policy policy;
+  boolean net; /* handle is a connected UDP socket */
+  boolean rtp; /* with RTP header per datagram */
+  uint16_t rtp_sequence;
+  uint32_t rtp_ssrc;
+  int out; /* refc index of the next block to write */
+  int offset; /* bytes written of that block */
+  byte *carry; /* rest of a partially written block, that was dropped */
+  int carry_len;
+  int carry_alloc;
+  long dropped; /* bytes dropped, total */
+  t_clock ats_push; /* push time of the last block stamped as M2TS */
+  int ats_count; /* packets stamped with that push time so far */
+  boolean ats_started; /* a packet was stamped as M2TS */
+  t_clock ats_last; /* arrival time of the last packet stamped */
+  t_clock ats_ratetime; /* push time the rate measurement started with */
+  int64_t ats_ratebytes; /* bytes stamped since ats_ratetime */
+  long ats_rate; /* measured output rate, byte/s, 0 if not yet known */
+} sink_descr;
+
+/* Payload of an output block that is still kept in a stream buffer,
+ * parallel to the output control buffer:
+ */
+typedef struct {
+  stream_descr *stream;
+  byte *ptr; /* NULL if the whole block is in the output buffer */
+  int size; /* number of payload bytes at the end of the block */
+} payload_ref;
 
 static refr_ctrl refc;
 static refr_data refd;
+static payload_ref *refp;
 
-static int outf;
+static sink_descr *sink;
+static int sink_alloc;
+static int sinks;
+static boolean sink_implicit; /* sink[0] is stdout, as no sink was given */
 
 static boolean outtrigger;
-static int outdelta;
+static t_clock outdelta;
 static t_msec trigger_msec_output;
 
 static int next_size;
+static int write_burst;
+static boolean m2ts; /* file sinks get M2TS arrival time stamps */
+static long m2ts_muxrate; /* constant mux rate in bit/s, 0 if variable */
 
 static t_msec statistics_msec;
-static t_msec statistics_next;
+static t_clock statistics_next;
 static int statistics_load;
 static int statistics_bursts;
 static int statistics_refd_min;
@@ -52,14 +114,288 @@ static int statistics_time_min;
 static int statistics_time_max;
 static int statistics_burst_min;
 static int statistics_burst_max;
+static int statistics_iov_max;
+static int statistics_drop;
+
+/* Add a sink, reading all data that is pushed from now on.
+ * The first sink given replaces the implicit stdout.
+ * Precondition: handle>=0, name!=NULL
+ * Return: sink if successful, NULL otherwise
+ */
+static sink_descr *output_newsink (int handle,
+    char *name,
+    sink_policy policy)
+{
+  sink_descr *k;
+  if (sink_implicit) {
+    sinks = 0;
+    sink_implicit = FALSE;
+  }
+  if (!table_reserve (&sink,&sink_alloc,sinks + 1,sizeof (*sink))) {
+    return (NULL);
+  }
+  k = &sink[sinks];
+  memset (k,0,sizeof (*k));
+  if ((k->name = malloc (strlen (name) + 1)) == NULL) {
+    warn (LERR,"Alloc fail",EOUT,8,1,sinks);
+    return (NULL);
+  }
+  strcpy (k->name,name);
+  k->handle = handle;
+  k->policy = policy;
+  k->out = refc.in;
+  sinks += 1;
+  return (k);
+}
+
+/* Release the stream buffer space of the payload of a block, as far as
+ * it is referenced. The stream buffer is released up to the end of the
+ * payload, or completely if no more payload is referenced.
+ * Precondition: 0<=o<=refc.mask
+ */
+static void output_unreference (int o)
+{
+  payload_ref *r = &refp[o];
+  stream_descr *s;
+  if (r->ptr != NULL) {
+    s = r->stream;
+    if (--s->u.d.outrefs > 0) {
+      s->data.out = (r->ptr + r->size - s->data.ptr) & s->data.mask;
+    } else {
+      s->data.out = s->u.d.outdone;
+    }
+    r->ptr = NULL;
+  }
+}
+
+/* Copy all payload that is referenced in the buffer of a stream into
+ * the output buffer, so that the stream buffer space is released.
+ * Precondition: s!=NULL
+ */
+void output_materialize (stream_descr *s)
+{
+  int o;
+  payload_ref *r;
+  if (s->u.d.outrefs > 0) {
+    o = refc.out;
+    while (o != refc.in) {
+      r = &refp[o];
+      if ((r->ptr != NULL)
+       && (r->stream == s)) {
+        memcpy (&refd.ptr[refc.ptr[o].index + refc.ptr[o].length - r->size],
+            r->ptr,r->size);
+        r->ptr = NULL;
+      }
+      list_incr (o,refc,1);
+    }
+    s->u.d.outrefs = 0;
+    s->data.out = s->u.d.outdone;
+  }
+}
+
+/* Leave the payload of the block pushed last in the buffer of a stream,
+ * instead of copying it. d points to where the payload would go.
+ * The stream buffer is released by the output, when all sinks have
+ * written the block. If the stream keeps more than a quarter of its
+ * buffer this way, the payload is copied, see output_materialize.
+ * Precondition: s!=NULL, s->streamdata==sd_data,
+ *               s->u.d.outdone is beyond the payload,
+ *               d+size is the end of the block pushed last
+ */
+void output_reference (byte *d,
+    stream_descr *s,
+    byte *payload,
+    int size)
+{
+  int o;
+  ctrl_buffer *c;
+  o = refc.in;
+  list_incr (o,refc,-1);
+  c = &refc.ptr[o];
+  if ((list_empty (refc))
+   || (d + size != &refd.ptr[c->index + c->length])) {
+    warn (LERR,"Reference",EOUT,9,1,size);
+    memcpy (d,payload,size);
+    if (s->u.d.outrefs == 0) {
+      s->data.out = s->u.d.outdone;
+    }
+    return;
+  }
+  refp[o].stream = s;
+  refp[o].ptr = payload;
+  refp[o].size = size;
+  s->u.d.outrefs += 1;
+  if (((payload + size - s->data.ptr - s->data.out) & s->data.mask)
+      > ((s->data.mask + 1) >> 2)) {
+    output_materialize (s);
+  }
+}
+
+/* Append the data of a block from offset off on to a list of segments,
+ * merging adjacent segments.
+ * Precondition: 0<=o<=refc.mask, 0<=off<refc.ptr[o].length,
+ *               two more segments fit into iov
+ * Return: new number of segments
+ */
+static int output_segments (int o,
+    int off,
+    struct iovec *iov,
+    int v)
+{
+  byte *d[2];
+  int l[2];
+  int i, n;
+  d[0] = &refd.ptr[refc.ptr[o].index];
+  l[0] = refc.ptr[o].length;
+  n = 1;
+  if (refp[o].ptr != NULL) {
+    l[0] -= refp[o].size;
+    d[1] = refp[o].ptr;
+    l[1] = refp[o].size;
+    n = 2;
+  }
+  i = 0;
+  while (i < n) {
+    if (off >= l[i]) {
+      off -= l[i];
+    } else {
+      if ((v > 0)
+       && ((byte *)iov[v-1].iov_base + iov[v-1].iov_len == d[i] + off)) {
+        iov[v-1].iov_len += l[i] - off;
+      } else {
+        iov[v].iov_base = d[i] + off;
+        iov[v].iov_len = l[i] - off;
+        v += 1;
+      }
+      off = 0;
+    }
+    i += 1;
+  }
+  return (v);
+}
+
+/* Release the output buffer as far as all sinks have written it.
+ */
+static void output_reclaim (void)
+{
+  int i, d, m;
+  m = list_size (refc);
+  i = sinks;
+  while (--i >= 0) {
+    d = (sink[i].out - refc.out) & refc.mask;
+    if (d < m) {
+      m = d;
+    }
+  }
+  while (--m >= 0) {
+    output_unreference (refc.out);
+    list_incr (refc.out,refc,1);
+  }
+  if (list_empty (refc)) {
+    refd.out = refd.in = 0;
+  } else {
+    refd.out = refc.ptr[refc.out].index;
+  }
+}
+
+/* Close a sink and forget it, e.g. as it did not keep up.
+ * Precondition: 0<=i<sinks
+ */
+static void output_closesink (int i)
+{
+  sink_descr *k = &sink[i];
+  warn (LWAR,"Disconnect",EOUT,8,2,i);
+  warn (LWAR,k->name,EOUT,8,3,k->dropped);
+  dispatch_forget (k->handle);
+  close (k->handle);
+  free (k->name);
+  free (k->carry);
+  sink[i] = sink[--sinks];
+  if (sinks == 0) {
+    warn (LWAR,"No sink left",EOUT,8,4,0);
+  }
+  output_reclaim ();
+}
+
+/* Drop the next block of a sink. If it is written partially,
+ * keep the rest to be written, so the data stays aligned.
+ * Precondition: k->out!=refc.in
+ */
+static void output_dropblock (sink_descr *k)
+{
+  struct iovec iov [2];
+  int i, l, v;
+  l = refc.ptr[k->out].length - k->offset;
+  if ((k->offset > 0)
+   && table_reserve (&k->carry,&k->carry_alloc,k->carry_len + l,1)) {
+    v = output_segments (k->out,k->offset,&iov[0],0);
+    i = 0;
+    while (i < v) {
+      memcpy (&k->carry[k->carry_len],iov[i].iov_base,iov[i].iov_len);
+      k->carry_len += iov[i].iov_len;
+      i += 1;
+    }
+  } else {
+    k->dropped += l;
+    statistics_drop += l;
+  }
+  k->offset = 0;
+  list_incr (k->out,refc,1);
+}
+
+/* Make room in the output buffer at the cost of the slowest sink,
+ * if it lags behind with data that is due, according to its policy.
+ * A blocking sink at the slowest position prevents any release.
+ */
+static void output_release (void)
+{
+  int i, k, d, m;
+  t_clock due;
+  if (!outtrigger) {
+    return;
+  }
+  due = clock_now () - outdelta;
+  while ((list_full (refc) || (list_free (refd) < next_size))
+      && (sinks > 0)) {
+    k = -1;
+    m = list_size (refc);
+    i = sinks;
+    while (--i >= 0) {
+      d = (sink[i].out - refc.out) & refc.mask;
+      if ((d < m)
+       || ((d == m) && (sink[i].policy == sp_block))) {
+        m = d;
+        k = i;
+      }
+    }
+    if ((k < 0)
+     || (sink[k].policy == sp_block)
+     || (refc.ptr[sink[k].out].clockpush > due)) {
+      return;
+    }
+    if (sink[k].policy == sp_disconnect) {
+      output_closesink (k);
+    } else {
+      output_dropblock (&sink[k]);
+      output_reclaim ();
+    }
+  }
+}
 
 boolean output_init (void)
 {
-  int r;
+  int r, outf;
   struct stat outstat;
   outtrigger = FALSE;
+  sink = NULL;
+  sink_alloc = 0;
+  sinks = 0;
+  sink_implicit = FALSE;
   trigger_msec_output = TRIGGER_MSEC_OUTPUT;
   next_size = HIGHWATER_OUT;
+  write_burst = MAX_WRITE_OUT;
+  m2ts = FALSE;
+  m2ts_muxrate = 0;
   statistics_msec = 0;
   if (!list_create (refc,MAX_CTRL_OUTB)) {
     return (FALSE);
@@ -67,6 +403,9 @@ boolean output_init (void)
   if (!list_create (refd,MAX_DATA_OUTB)) {
     return (FALSE);
   }
+  if ((refp = calloc (MAX_CTRL_OUTB,sizeof (*refp))) == NULL) {
+    return (FALSE);
+  }
   r = -1;
   outf = STDOUT_FILENO;
 
@@ -89,7 +428,132 @@ boolean output_init (void)
   if (!S_ISREG (outstat.st_mode)) {
     timed_io = TRUE;
   }
-  return (outf >= 0);
+  if (output_newsink (outf,"-",sp_block) == NULL) {
+    return (FALSE);
+  }
+  sink_implicit = TRUE;
+  return (TRUE);
+}
+
+/* Add a file as output sink, "-" denoting stdout.
+ * Once a sink is given, stdout is not written unless given as well.
+ * Precondition: name!=NULL
+ * Return: TRUE if successful, FALSE otherwise
+ */
+boolean output_addsink (char *name,
+    sink_policy policy)
+{
+  struct stat outstat;
+  int h, r;
+  if (!strcmp (name,"-")) {
+    h = STDOUT_FILENO;
+  } else if ((h = open (name,O_WRONLY|O_CREAT|O_TRUNC|O_NONBLOCK,0666)) < 0) {
+    warn (LERR,"Cannot open",EOUT,5,3,errno);
+    return (FALSE);
+  }
+  if ((fstat (h,&outstat) != 0)
+   || ((r = fcntl (h,F_GETFL)) < 0)
+   || (fcntl (h,F_SETFL,r | O_NONBLOCK) < 0)) {
+    warn (LERR,"Cannot fcntl",EOUT,5,4,errno);
+  } else if (output_newsink (h,name,policy) != NULL) {
+    if (!S_ISREG (outstat.st_mode)) {
+      timed_io = TRUE;
+    }
+    return (TRUE);
+  }
+  if (h != STDOUT_FILENO) {
+    close (h);
+  }
+  return (FALSE);
+}
+
+/* Add a UDP destination as output sink.
+ * address is host:port, the host may be a multicast group, an IPv6
+ * address is to be bracketed. ttl>0 sets the multicast hop limit.
+ * If rtp, each datagram is preceded by an RTP header (RFC 2250).
+ * Return: TRUE if successful, FALSE otherwise
+ */
+boolean output_setnet (char *address,
+    int ttl,
+    boolean rtp,
+    sink_policy policy)
+{
+  sink_descr *k;
+  struct addrinfo hints, *ai, *a;
+  char *host, *port;
+  int s, r;
+  if ((host = malloc (strlen (address) + 1)) == NULL) {
+    warn (LERR,"Alloc fail",EOUT,6,1,0);
+    return (FALSE);
+  }
+  strcpy (host,address);
+  if ((port = strrchr (host,':')) == NULL) {
+    warn (LERR,"No port",EOUT,6,2,0);
+    free (host);
+    return (FALSE);
+  }
+  *port++ = 0;
+  s = strlen (host);
+  if ((s >= 2) && (host[0] == '[') && (host[s-1] == ']')) {
+    host[s-1] = 0;
+    memmove (&host[0],&host[1],s-1);
+  }
+  memset (&hints,0,sizeof (hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  if ((r = getaddrinfo (host,port,&hints,&ai)) != 0) {
+    warn (LERR,(char *)gai_strerror (r),EOUT,6,3,r);
+    free (host);
+    return (FALSE);
+  }
+  free (host);
+  s = -1;
+  for (a = ai; a != NULL; a = a->ai_next) {
+    if ((s = socket (a->ai_family,a->ai_socktype,a->ai_protocol)) >= 0) {
+      if (connect (s,a->ai_addr,a->ai_addrlen) == 0) {
+        if (ttl > 0) {
+          r = (a->ai_family == AF_INET6)
+            ? setsockopt (s,IPPROTO_IPV6,IPV6_MULTICAST_HOPS,&ttl,sizeof (ttl))
+            : setsockopt (s,IPPROTO_IP,IP_MULTICAST_TTL,&ttl,sizeof (ttl));
+          if (r != 0) {
+            warn (LWAR,"Cannot set ttl",EOUT,6,4,errno);
+          }
+        }
+        break;
+      }
+      close (s);
+      s = -1;
+    }
+  }
+  freeaddrinfo (ai);
+  if ((s < 0)
+   || ((r = fcntl (s,F_GETFL)) < 0)
+   || (fcntl (s,F_SETFL,r | O_NONBLOCK) < 0)) {
+    warn (LERR,"Cannot connect",EOUT,6,5,errno);
+    if (s >= 0) {
+      close (s);
+    }
+    return (FALSE);
+  }
+  if ((k = output_newsink (s,address,policy)) == NULL) {
+    close (s);
+    return (FALSE);
+  }
+  k->net = TRUE;
+  k->rtp = rtp;
+  k->rtp_sequence = clock_now ();
+  k->rtp_ssrc = (getpid () << 16) ^ (uint32_t)clock_now () ^ sinks;
+  timed_io = TRUE;
+  return (TRUE);
+}
+
+/* Determine the number of sinks, i.e. the number of handles
+ * output_available may ask for at most.
+ * Return: number of sinks
+ */
+int output_sinkcount (void)
+{
+  return (sinks);
 }
 
 /* Calculate the free space in the output buffer
@@ -113,19 +577,20 @@ static int output_free (void)
 boolean output_acceptable (void)
 {
   warn (LDEB,"Acceptable",EOUT,2,0,next_size);
+  output_release ();
   return (output_free () >= next_size);
 }
 
 /* Reserve space in the output buffer.
  * size is the number of bytes wanted.
- * if timed==TRUE, then push is a time stamp (millisec),
+ * if timed==TRUE, then push is a time stamp (27MHz ticks),
  * otherwise a time stamp for greedy processing is calculated locally.
  * Precondition: size>0
  * Return: Pointer to data block, if available, NULL otherwise
  */
 byte *output_pushdata (int size,
     boolean timed,
-    int push)
+    t_clock push)
 {
   ctrl_buffer *c;
   byte *d;
@@ -146,9 +611,11 @@ byte *output_pushdata (int size,
   c = &refc.ptr[refc.in];
   c->index = refd.in;
   c->length = size;
-  c->msecpush = timed
+  c->clockpush = timed
               ? push
-              : (msec_now () - (outtrigger ? outdelta : trigger_msec_output));
+              : (clock_now () - (outtrigger ? outdelta
+                                : msec2clock (trigger_msec_output)));
+  refp[refc.in].ptr = NULL;
   list_incr (refc.in,refc,1);
   d = &refd.ptr[refd.in];
   list_incr (refd.in,refd,size);
@@ -159,7 +626,7 @@ byte *output_pushdata (int size,
       statistics_refd_max = tmp;
     }
     if (timed) {
-      tmp = push + outdelta - msec_now ();
+      tmp = clock2msec (push + outdelta - clock_now ());
       if (tmp > statistics_time_max) {
         statistics_time_max = tmp;
       }
@@ -176,51 +643,85 @@ void output_settriggertiming (t_msec time)
   trigger_msec_output = time;
 }
 
-/* Check whether data is available to be written to stdout.
- * If so, set the poll struct accordingly.
- * Check the time stamp and set the timeout^ accordingly.
+/* Set the maximum size of a write burst, i.e. the number of bytes
+ * to be gathered for a single write operation.
+ */
+void output_setburst (int size)
+{
+  write_burst = size;
+}
+
+/* Switch file sinks to M2TS, i.e. 192 byte packets with a time stamp.
+ */
+void output_setm2ts (void)
+{
+  m2ts = TRUE;
+}
+
+/* Tell the constant mux rate (bit/s, 0 if variable), that M2TS arrival
+ * time stamps of packets pushed at the same time are spaced by.
+ */
+void output_setmuxrate (long rate)
+{
+  m2ts_muxrate = rate;
+}
+
+/* Check whether data is available to be written to the sinks.
+ * If so, set a poll struct accordingly for each sink in question.
+ * Check the time stamps and set the timeout^ accordingly.
  * Return: TRUE, if data is available to be written immediately,
  *         FALSE otherwise.
  */ 
 boolean output_available (unsigned int *nfds,
     struct pollfd *ufds,
-    t_msec *timeout)
+    t_clock *timeout)
 {
-  t_msec t, now;
+  t_clock t, s, now;
   boolean avail;
+  int i;
   t = -1;
   avail = FALSE;
-  now = msec_now ();
+  now = clock_now ();
   if (list_empty (refc)) {
     warn (LDEB,"Available Empty",EOUT,4,1,0);
     /* outtrigger = FALSE; */
     /* and discontinuity things */
   } else {
-    t = refc.ptr[refc.out].msecpush - now;
+    t = refc.ptr[refc.out].clockpush - now;
     if (!outtrigger) {
       if (list_partialfull (refd)
-       || (-t >= trigger_msec_output)) {
+       || (-t >= msec2clock (trigger_msec_output))) {
         outdelta = -t;
         warn (LDEB,"Available Trigger",EOUT,4,2,outdelta);
         outtrigger = TRUE;
       }
     }
-    if (outtrigger) {
-      t += outdelta;
-      if (t <= 0) {
-        warn (LDEB,"Available",EOUT,4,3,t);
-        ufds->fd = outf;
-        ufds->events = POLLOUT;
-        *nfds += 1;
-        avail = TRUE;
-        t = -1;
+    if (!outtrigger) {
+      t += msec2clock (trigger_msec_output);
+    }
+  }
+  if (outtrigger) {
+    t = -1;
+    i = sinks;
+    while (--i >= 0) {
+      if ((sink[i].carry_len > 0)
+       || (sink[i].out != refc.in)) {
+        s = (sink[i].carry_len > 0) ? 0
+          : refc.ptr[sink[i].out].clockpush + outdelta - now;
+        if (s <= 0) {
+          warn (LDEB,"Available",EOUT,4,3,s);
+          ufds->fd = sink[i].handle;
+          ufds->events = POLLOUT;
+          ufds++;
+          *nfds += 1;
+          avail = TRUE;
+        } else if ((t < 0) || (s < t)) {
+          t = s;
+        }
       }
-    } else {
-      t += trigger_msec_output;
     }
   }
   if ((statistics_msec > 0) && (statistics_load > 0)) {
-    t_msec s;
     s = statistics_next - now;
     if (s < 0) {
       s = 0;
@@ -240,16 +741,19 @@ void output_set_statistics (t_msec time)
   int tmp;
   statistics_msec = time;
   if (time > 0) {
-    statistics_next = msec_now () + time;
+    statistics_next = clock_now () + msec2clock (time);
   }
   statistics_load = 0;
   statistics_bursts = 0;
   statistics_refd_min = statistics_refd_max = list_size (refd);
   statistics_burst_min = statistics_burst_max = 0;
+  statistics_iov_max = 0;
+  statistics_drop = 0;
   statistics_time_min = statistics_time_max =
       list_empty (refc) ? 0 :
         (tmp = refc.in,
-         refc.ptr[list_incr (tmp,refc,-1)].msecpush + outdelta - msec_now ()); 
+         clock2msec (refc.ptr[list_incr (tmp,refc,-1)].clockpush
+           + outdelta - clock_now ()));
 }
 
 /* Generate statistics, if the time is right for this.
@@ -257,25 +761,30 @@ void output_set_statistics (t_msec time)
 void output_gen_statistics (void)
 {
   if (statistics_msec > 0) {
-    t_msec now;
-    int tmp;
-    now = msec_now ();
+    t_clock now;
+    int tmp, locks, unlocks;
+    now = clock_now ();
     if (now >= statistics_next) {
-      fprintf (stderr, "Stat: now:%8d out:%8d/%4d buf:%8d..%8d time:%6d..%6d burst:%6d..%6d\n",
-          now, statistics_load, statistics_bursts,
+      input_syncevents (&locks,&unlocks);
+      fprintf (stderr, "Stat: now:%8d out:%8d/%4d buf:%8d..%8d time:%6d..%6d burst:%6d..%6d iov:%4d drop:%8d sync:%3d/%3d\n",
+          clock2msec (now), statistics_load, statistics_bursts,
           statistics_refd_min, statistics_refd_max,
           statistics_time_min, statistics_time_max,
-          statistics_burst_min, statistics_burst_max);
+          statistics_burst_min, statistics_burst_max,
+          statistics_iov_max, statistics_drop, locks, unlocks);
       statistics_load = 0;
       statistics_bursts = 0;
       statistics_refd_min = statistics_refd_max = list_size (refd);
       statistics_burst_min = statistics_burst_max;
       statistics_burst_max = 0;
+      statistics_iov_max = 0;
+      statistics_drop = 0;
       statistics_time_min = statistics_time_max =
           list_empty (refc) ? 0 :
             (tmp = refc.in,
-             refc.ptr[list_incr (tmp,refc,-1)].msecpush + outdelta - now),
-      statistics_next = now + statistics_msec;
+             clock2msec (refc.ptr[list_incr (tmp,refc,-1)].clockpush
+               + outdelta - now)),
+      statistics_next = now + msec2clock (statistics_msec);
     }
   }
 }
@@ -285,29 +794,276 @@ void output_gen_statistics (void)
  */
 void output_finish (void)
 {
+  int i;
   outtrigger = TRUE;
   output_set_statistics (0);
+  i = sinks;
+  while (--i >= 0) {
+    if (sink[i].dropped > 0) {
+      warn (LWAR,"Dropped",EOUT,8,5,sink[i].dropped);
+      warn (LWAR,sink[i].name,EOUT,8,6,i);
+    }
+  }
 }
 
-/* Write some data to stdout from the output buffer.
- * Write as much data as available unwrapped and with identical time stamp.
- * Precondition: poll has stated data or error for stdout
+/* Send gathered data as UDP datagrams of up to MAX_DGRAM_PACKETS TS
+ * packets each, many of them with a single operation. With RTP, the
+ * time stamp is the 90kHz time of sending. If the data was cut at the
+ * burst size, a partial datagram at the end is kept for the next time.
+ * Return: number of data bytes sent, -1 on failure
  */
-void output_something (boolean writeable)
+static int output_sendnet (sink_descr *k,
+    struct iovec *iov,
+    int v,
+    boolean cut)
 {
-  t_msec msec;
-  int i, l, o;
-  o = refc.out;
-  msec = refc.ptr[o].msecpush;
-  i = refc.ptr[o].index;
+  static struct mmsghdr msg [MAX_DGRAM_BURST];
+  static struct iovec dgiov [MAX_DGRAM_BURST][MAX_DGRAM_IOV];
+  static byte rtp [MAX_DGRAM_BURST][RTP_HEADER_SIZE];
+  int size [MAX_DGRAM_BURST];
+  uint32_t stamp;
+  int i, j, m, n, c, off, r;
+  stamp = clock_now () / 300;
+  m = 0;
+  i = 0;
+  off = 0;
+  while ((m < MAX_DGRAM_BURST)
+      && (i < v)) {
+    j = 0;
+    n = 0;
+    if (k->rtp) {
+      byte *h = &rtp[m][0];
+      uint16_t seq = k->rtp_sequence + m;
+      h[0] = RTP_VERSION;
+      h[1] = RTP_PAYLOAD_MP2T;
+      h[2] = seq >> 8;
+      h[3] = seq;
+      h[4] = stamp >> 24;
+      h[5] = stamp >> 16;
+      h[6] = stamp >> 8;
+      h[7] = stamp;
+      h[8] = k->rtp_ssrc >> 24;
+      h[9] = k->rtp_ssrc >> 16;
+      h[10] = k->rtp_ssrc >> 8;
+      h[11] = k->rtp_ssrc;
+      dgiov[m][j].iov_base = h;
+      dgiov[m][j++].iov_len = RTP_HEADER_SIZE;
+    }
+    while ((n < DGRAM_SIZE)
+        && (i < v)
+        && (j < MAX_DGRAM_IOV)) {
+      c = mmin (iov[i].iov_len - off, DGRAM_SIZE - n);
+      dgiov[m][j].iov_base = (byte *)iov[i].iov_base + off;
+      dgiov[m][j++].iov_len = c;
+      n += c;
+      off += c;
+      if (off == iov[i].iov_len) {
+        i += 1;
+        off = 0;
+      }
+    }
+    if (cut
+     && (m > 0)
+     && (n < DGRAM_SIZE)
+     && (i >= v)) {
+      break;
+    }
+    memset (&msg[m],0,sizeof (msg[m]));
+    msg[m].msg_hdr.msg_iov = &dgiov[m][0];
+    msg[m].msg_hdr.msg_iovlen = j;
+    size[m] = n;
+    m += 1;
+  }
+  r = sendmmsg (k->handle,&msg[0],m,0);
+  if (r < m) {
+    dispatch_drained (k->handle,POLLOUT);
+  }
+  if (r < 0) {
+    if ((errno != EAGAIN)
+     && (errno != EWOULDBLOCK)) {
+      warn (LWAR,"Send fail",EOUT,7,1,errno);
+    }
+    return (-1);
+  }
+  k->rtp_sequence += r;
+  n = 0;
+  for (i = 0; i < r; i++) {
+    n += size[i];
+  }
+  return (n);
+}
+
+/* Find the 27MHz arrival time of the next TS packet of a block to be
+ * written as M2TS. The n-th packet pushed at the same time arrives
+ * n packet times after that time, at the constant mux rate if set, or
+ * else at the output rate measured over about a second. Arrival times
+ * increase strictly, also while the rate is not yet known.
+ * Precondition: k!=NULL
+ */
+static t_clock output_arrival (sink_descr *k,
+    t_clock push)
+{
+  t_clock t;
+  if (push != k->ats_push) {
+    k->ats_push = push;
+    k->ats_count = 0;
+  }
+  t = push + outdelta;
+  if (m2ts_muxrate > 0) {
+    t += (int64_t)k->ats_count * TS_PACKET_SIZE * 8 * CLOCK_HZ
+       / m2ts_muxrate;
+  } else if (k->ats_rate > 0) {
+    t += (int64_t)k->ats_count * TS_PACKET_SIZE * CLOCK_HZ / k->ats_rate;
+  }
+  k->ats_count += 1;
+  if ((k->ats_started)
+   && ((t - k->ats_last) <= 0)) {
+    t = k->ats_last + 1;
+  }
+  k->ats_started = TRUE;
+  k->ats_last = t;
+  return (t);
+}
+
+/* Measure the output rate of a sink, from the bytes of the blocks
+ * stamped as M2TS and their push times.
+ * Precondition: k!=NULL
+ */
+static void output_arrivalrate (sink_descr *k,
+    t_clock push,
+    int bytes)
+{
+  t_clock span;
+  if (k->ats_ratebytes <= 0) {
+    k->ats_ratetime = push;
+  }
+  k->ats_ratebytes += bytes;
+  span = push - k->ats_ratetime;
+  if (span < 0) {
+    k->ats_ratetime = push;
+    k->ats_ratebytes = bytes;
+  } else if ((span >= CLOCK_HZ)
+   || ((k->ats_rate <= 0)
+    && (span >= (CLOCK_HZ / 8)))) {
+    k->ats_rate = (k->ats_ratebytes - bytes) * CLOCK_HZ / span;
+    k->ats_ratetime = push;
+    k->ats_ratebytes = bytes;
+  }
+}
+
+/* Convert the blocks of a sink that are due, to be written as M2TS.
+ * Each TS packet is copied to the carry buffer, preceded by an arrival
+ * time stamp, that is the 27MHz time at which the packet is due, see
+ * output_arrival.
+ * The blocks are done with, as far as the sink is concerned.
+ * Precondition: k->carry_len==0, k->offset==0
+ */
+static void output_m2ts (sink_descr *k,
+    t_clock due)
+{
+  struct iovec iov [2];
+  t_clock push;
+  uint32_t a;
+  byte *d;
+  int c, i, l, n, off, v;
+  push = refc.ptr[k->out].clockpush;
+  l = 0;
+  while ((l < write_burst)
+      && (k->out != refc.in)
+      && ((refc.ptr[k->out].clockpush == push)
+       || (refc.ptr[k->out].clockpush <= due))
+      && table_reserve (&k->carry,&k->carry_alloc,k->carry_len
+           + refc.ptr[k->out].length / TS_PACKET_SIZE * TS_STRIDE_M2TS,1)) {
+    output_arrivalrate (k,refc.ptr[k->out].clockpush,
+        refc.ptr[k->out].length);
+    v = output_segments (k->out,0,&iov[0],0);
+    n = 0;
+    i = 0;
+    off = 0;
+    while (i < v) {
+      if ((n % TS_PACKET_SIZE) == 0) {
+        a = output_arrival (k,refc.ptr[k->out].clockpush) & TS_ARRIVAL_MASK;
+        d = &k->carry[k->carry_len];
+        d[0] = a >> 24;
+        d[1] = a >> 16;
+        d[2] = a >> 8;
+        d[3] = a;
+        k->carry_len += TS_STRIDE_M2TS - TS_PACKET_SIZE;
+      }
+      c = mmin (iov[i].iov_len - off,TS_PACKET_SIZE - (n % TS_PACKET_SIZE));
+      memcpy (&k->carry[k->carry_len],(byte *)iov[i].iov_base + off,c);
+      k->carry_len += c;
+      n += c;
+      off += c;
+      if (off == iov[i].iov_len) {
+        i += 1;
+        off = 0;
+      }
+    }
+    l += n;
+    list_incr (k->out,refc,1);
+  }
+  output_reclaim ();
+}
+
+/* Write some data to a sink from the output buffer.
+ * Gather all data that is due, i.e. with the same time stamp as the first
+ * block or a time stamp that has passed, up to the burst size, and write it
+ * with a single operation. Adjacent blocks are merged into one segment.
+ * A sink to be disconnected is closed on error.
+ * Precondition: poll has stated data or error for the handle
+ */
+void output_something (int handle,
+    boolean writeable)
+{
+  struct iovec iov [MAX_WRITE_IOV];
+  t_clock push, due;
+  sink_descr *k;
+  int i, l, n, o, v;
+  i = sinks;
+  while ((--i >= 0)
+      && (sink[i].handle != handle)) {
+  }
+  if (i < 0) {
+    return;
+  }
+  k = &sink[i];
   l = 0;
   if (writeable) {
-    do {
-      l += refc.ptr[o].length;
-    } while ((l < MAX_WRITE_OUT)
+    v = 0;
+    due = clock_now () - outdelta;
+    push = due;
+    if (m2ts
+     && (!k->net)
+     && (k->carry_len == 0)
+     && (k->out != refc.in)
+     && (refc.ptr[k->out].clockpush <= due)) {
+      push = refc.ptr[k->out].clockpush;
+      output_m2ts (k,due);
+    }
+    if (k->carry_len > 0) {
+      iov[0].iov_base = k->carry;
+      iov[0].iov_len = k->carry_len;
+      v = 1;
+      l = k->carry_len;
+    }
+    o = k->out;
+    if ((o != refc.in)
+     && (!m2ts || k->net)
+     && ((v == 0)
+      || (refc.ptr[o].clockpush <= due))) {
+      push = refc.ptr[o].clockpush;
+      v = output_segments (o,k->offset,&iov[0],v);
+      l += refc.ptr[o].length - k->offset;
+      while ((l < write_burst)
           && (list_incr (o,refc,1) != refc.in)
-          && (refc.ptr[o].msecpush == msec)
-          && (refc.ptr[o].index == (i+l))); /* and < MAX_WRITE_OUT */
+          && ((refc.ptr[o].clockpush == push)
+           || (refc.ptr[o].clockpush <= due))
+          && (v <= MAX_WRITE_IOV - 2)) {
+        v = output_segments (o,0,&iov[0],v);
+        l += refc.ptr[o].length;
+      }
+    }
     warn (LDEB,"Something",EOUT,0,1,l);
     if (statistics_msec > 0) {
       if (l < statistics_burst_min) {
@@ -316,31 +1072,55 @@ void output_something (boolean writeable)
       if (l > statistics_burst_max) {
         statistics_burst_max = l;
       }
+      if (v > statistics_iov_max) {
+        statistics_iov_max = v;
+      }
     }
-    l = write (outf,&refd.ptr[i],l);
+    n = l;
+    if (k->net) {
+      l = output_sendnet (k,&iov[0],v,(l >= write_burst));
+    } else {
+      l = (v == 1) ? write (k->handle,iov[0].iov_base,l)
+                   : writev (k->handle,&iov[0],v);
+      if (l < n) {
+        dispatch_drained (k->handle,POLLOUT);
+      }
+      if ((l < 0)
+       && (errno != EAGAIN)
+       && (errno != EINTR)
+       && (k->policy == sp_disconnect)) {
+        output_closesink (i);
+        return;
+      }
+    }
+  } else if (k->policy == sp_disconnect) {
+    output_closesink (i);
+    return;
   }
   warn (LDEB,"Some Written",EOUT,0,2,l);
   if (l > 0) {
     statistics_load += l;
     statistics_bursts += 1;
-    o = refc.out;
-    do {
-      if (l < refc.ptr[o].length) {
-        refc.ptr[o].length -= l;
-        refc.ptr[o].index += l;
-        warn (LDEB,"Some Left",EOUT,0,3,refc.ptr[o].length);
+    n = mmin (l,k->carry_len);
+    if (n > 0) {
+      k->carry_len -= n;
+      memmove (&k->carry[0],&k->carry[n],k->carry_len);
+      l -= n;
+    }
+    while (l > 0) {
+      n = refc.ptr[k->out].length - k->offset;
+      if (l < n) {
+        k->offset += l;
+        warn (LDEB,"Some Left",EOUT,0,3,n - l);
         l = 0;
       } else {
-        warn (LDEB,"Some Done",EOUT,0,4,o);
-        l -= refc.ptr[o].length;
-        refc.out = list_incr (o,refc,1);
+        warn (LDEB,"Some Done",EOUT,0,4,k->out);
+        l -= n;
+        k->offset = 0;
+        list_incr (k->out,refc,1);
       }
-    } while (l > 0);
-    if (list_empty (refc)) {
-      refd.out = refd.in = 0;
-    } else {
-      refd.out = refc.ptr[o].index;
     }
+    output_reclaim ();
     if (statistics_msec > 0) {
       int tmp, tin;
       tmp = list_size (refd);
@@ -349,11 +1129,11 @@ void output_something (boolean writeable)
       }
       tmp = list_empty (refc) ? 0 :
         (tin = refc.in,
-         refc.ptr[list_incr (tin,refc,-1)].msecpush + outdelta - msec);
+         clock2msec (refc.ptr[list_incr (tin,refc,-1)].clockpush
+           + outdelta - push));
       if (tmp < statistics_time_min) {
         statistics_time_min = tmp;
       }
     }
   }
 }
-
@@ -23,13 +23,29 @@ boolean output_init (void);
 boolean output_acceptable (void);
 byte *output_pushdata (int size,
     boolean timed,
-    int push);
+    t_clock push);
+void output_reference (byte *d,
+    stream_descr *s,
+    byte *payload,
+    int size);
+void output_materialize (stream_descr *s);
 void output_settriggertiming (t_msec time);
+void output_setburst (int size);
+void output_setm2ts (void);
+void output_setmuxrate (long rate);
+boolean output_addsink (char *name,
+    sink_policy policy);
+boolean output_setnet (char *address,
+    int ttl,
+    boolean rtp,
+    sink_policy policy);
+int output_sinkcount (void);
 boolean output_available (unsigned int *nfds,
     struct pollfd *ufds,
-    t_msec *timeout);
+    t_clock *timeout);
 void output_set_statistics (t_msec time);
 void output_gen_statistics (void);
 void output_finish (void);
-void output_something (boolean writeable);
+void output_something (int handle,
+    boolean writeable);
 
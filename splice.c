@@ -33,7 +33,7 @@
 #include "pes.h"
 #include "descref.h"
 
-t_msec next_psi_periodic;
+t_clock next_psi_periodic;
 t_msec psi_frequency_msec;
 boolean psi_frequency_changed;
 
@@ -93,7 +93,8 @@ stream_descr *connect_streamprog (file_descr *f,
             if (xxx) {
               p->pcr_pid = s->u.d.pid;
               s->u.d.has_clockref = TRUE;
-              s->u.d.next_clockref = msec_now () - MAX_MSEC_PCRDIST;
+              s->u.d.next_clockref =
+                clock_now () - msec2clock (MAX_MSEC_PCRDIST);
             }
           }
 */
@@ -32,7 +32,7 @@ typedef struct modifydescrdescr {
   byte data[MAX_DESCR_LEN];
 } modifydescr_descr;
 
-extern t_msec next_psi_periodic;
+extern t_clock next_psi_periodic;
 extern t_msec psi_frequency_msec;
 extern boolean psi_frequency_changed;
 
@@ -104,6 +104,10 @@ void splice_setpsifrequency (t_msec freq);
  */
 void splice_setnetworkpid (short pid);
 
+/* Set the mux rate in bit/s for constant rate output. 0 denotes variable.
+ */
+void splice_setmuxrate (long rate);
+
 /* Print configuration for all target programs.
  */
 void splice_all_configuration (void);
@@ -146,6 +150,11 @@ boolean splice_delstream (prog_descr *p,
  */
 void process_finish (void);
 
+/* Process idle time, i.e. no stream data is due.
+ * With constant mux rate, fill the output with stuffing up to now.
+ */
+void process_idle (void);
+
 /* Process data from a stream.
  * If it is a map stream, then it is a set of descriptors, so just
  * validate them. Otherwise, if PSI information is due, generate it.
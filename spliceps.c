@@ -50,6 +50,40 @@ static byte psi_data [MAX_PSI_SIZE + PS_SYSTHD_SIZE + PS_STRMAP_SIZE +
 
 static prog_descr prog;
 
+/* Output mux rate: the bytes pushed are sampled over a sliding window
+ * of PS_RATE_MSEC, the mux_rate in the pack headers is derived thereof,
+ * unless a constant rate is set with --muxrate.
+ * rate_bound is fixed before the first system header is written, so that
+ * all system headers tell the same. A mux_rate beyond is not cut down,
+ * as the packs would then fall behind their data, but warned about.
+ */
+#define PS_RATE_SAMPLES 256
+#define PS_RATE_MSEC 1000
+#define PS_RATE_DEFAULT (4500000 / 400)
+#define PS_RATE_BOUND (10080000 / 400) /* highest rate of DVD video */
+#define PS_MSEC_PACKDEV 5 /* tolerance to place a PES into the last pack */
+
+#define PS_BOUND_VIDEO 237568
+#define PS_BOUND_AUDIO 4096
+#define PS_BOUND_OTHER 2048
+
+typedef struct {
+  t_clock time;
+  int64_t bytes;
+} rate_sample;
+
+static rate_sample rate_samples [PS_RATE_SAMPLES];
+static int rate_in, rate_out;
+static int64_t out_bytes;
+static long mux_rate;
+static long rate_bound;
+static long const_rate;
+static boolean rate_exceeded;
+static boolean pack_valid;
+static t_clock pack_scr;
+static int64_t pack_bytes;
+static long pack_rate;
+
 boolean splice_specific_init (void)
 {
   prog.program_number = 0;
@@ -60,6 +94,13 @@ boolean splice_specific_init (void)
   prog.stump = NULL;
   clear_descrdescr (&prog.manudescr);
   psi_size = 0;
+  rate_in = rate_out = 0;
+  out_bytes = 0;
+  mux_rate = 0;
+  rate_bound = 0;
+  const_rate = 0;
+  rate_exceeded = FALSE;
+  pack_valid = FALSE;
   return (TRUE);
 }
 
@@ -77,6 +118,15 @@ void splice_setnetworkpid (short pid)
 {
 }
 
+void splice_setmuxrate (long rate)
+{
+  warn (LIMP,"Mux rate",EPSC,7,const_rate,rate);
+  const_rate = (rate + 399) / 400;
+  if (const_rate > 0x3FFFFF) {
+    const_rate = 0x3FFFFF;
+  }
+}
+
 void splice_all_configuration (void)
 {
   if (configuration_must_print) {
@@ -154,7 +204,9 @@ int splice_addstream (prog_descr *p,
   /* add stream to main program */
   int sid = 0;
   warn (LIMP,"Add stream",EPSC,3,force_sid,s->stream_id);
-  if (prog.streams < MAX_STRPERPRG) {
+  if ((prog.streams < MAX_STRPERPRG)
+   && table_reserve (&prog.stream,&prog.stream_alloc,
+        prog.streams + 1,sizeof (*prog.stream))) {
     if (!force_sid) {
       s->stream_id = splice_findfreestreamid (&prog,s->stream_id);
     }
@@ -200,23 +252,92 @@ void process_finish (void)
   }
 }
 
+void process_idle (void)
+{
+}
+
+/* Encode a P-STD buffer size bound of at least b bytes.
+ * Video requires a scale of 1024 bytes, audio one of 128 bytes.
+ * Return: pointer behind the encoded two bytes
+ */
+static byte *put_bufferbound (byte *d,
+    int pid,
+    int b)
+{
+  int scale;
+  if ((pid >= PES_CODE_VIDEO)
+   && (pid < (PES_CODE_VIDEO + PES_NUMB_VIDEO))) {
+    scale = 1;
+  } else if ((pid >= PES_CODE_AUDIO)
+   && (pid < (PES_CODE_AUDIO + PES_NUMB_AUDIO))) {
+    scale = 0;
+  } else {
+    scale = (b > (0x1FFF * 128));
+  }
+  if (scale) {
+    b = (b + 1023) / 1024;
+  } else {
+    b = (b + 127) / 128;
+  }
+  if (b > 0x1FFF) {
+    b = 0x1FFF;
+  }
+  *d++ = 0xC0
+       | (scale << 5) /* buffer bound scale */
+       | (b >> 8);
+  *d++ = b;
+  return (d);
+}
+
+/* Find the P-STD buffer size bound of a stream: that of the system
+ * header of a program stream source, if it tells one, or else the usual
+ * default per stream type.
+ * Return: buffer size bound in bytes
+ */
+static int stream_bufferbound (stream_descr *t)
+{
+  int b, pid;
+  file_descr *f;
+  f = t->fdescr;
+  if ((f->content == ct_program)
+   && (t->sourceid >= PES_LOWEST_SID)
+   && (t->sourceid < MAX_STRPERPS)) {
+    b = f->u.ps.sh.buffer_bound[t->sourceid - PES_LOWEST_SID];
+    if (b < 0) {
+      return (-b * 1024);
+    } else if (b > 0) {
+      return (b * 128);
+    }
+  }
+  pid = t->u.d.pid;
+  if ((pid >= PES_CODE_VIDEO)
+   && (pid < (PES_CODE_VIDEO + PES_NUMB_VIDEO))) {
+    return (PS_BOUND_VIDEO);
+  } else if ((pid >= PES_CODE_AUDIO)
+   && (pid < (PES_CODE_AUDIO + PES_NUMB_AUDIO))) {
+    return (PS_BOUND_AUDIO);
+  }
+  return (PS_BOUND_OTHER);
+}
+
+/* Generate a system header for the current program, with the buffer
+ * bounds per stream as found by stream_bufferbound.
+ * Return: size of the system header
+ */
 static int make_systemheader (stream_descr *s,
     byte *dest)
 {
   int i, pid;
   byte v, a;
   byte *d;
+  stream_descr *t;
   d = dest;
   *d++ = 0x00;
   *d++ = 0x00;
   *d++ = 0x01;
   *d++ = PS_CODE_SYST_HDR;
   d += 2;
-  if (s->fdescr->content == ct_program) {
-    i = s->fdescr->u.ps.sh.ratebound;
-  } else {
-    i = 4500000 / 400; /* wrong for sure */
-  }
+  i = rate_bound;
   *d++ = 0x80
        | (i >> 15);
   *d++ = (i >> 7);
@@ -228,36 +349,17 @@ static int make_systemheader (stream_descr *s,
   a = v = 0;
   i = prog.streams;
   while (--i >= 0) {
-    pid = prog.stream[i]->u.d.pid;
+    t = prog.stream[i];
+    pid = t->u.d.pid;
     if ((pid >= PES_CODE_VIDEO)
      && (pid < (PES_CODE_VIDEO + PES_NUMB_VIDEO))) {
-      if (v == 0) {
-        *d++ = PES_JOKER_AUDIO;
-        *d++ = 0xC0
-             | (0 << 5) /* buffer bound scale */
-             | ((4096/128) >> 8);
-        *d++ = (4096/128) & 0xFF; /* fixme! propagate from input, or derive */
-      }
       v += 1;
-    } else {
-      if ((pid >= PES_CODE_AUDIO)
-       && (pid < (PES_CODE_AUDIO + PES_NUMB_AUDIO))) {
-        if (a == 0) {
-          *d++ = PES_JOKER_VIDEO;
-          *d++ = 0xC0
-               | (0 << 5) /* buffer bound scale */
-               | ((237568/128) >> 8);
-          *d++ = (237568/128) & 0xFF;
-        }
-        a += 1;
-      } else {
-        *d++ = pid;
-        *d++ = 0xC0
-             | (0 << 5) /* buffer bound scale */
-             | ((2048/128) >> 8);
-        *d++ = (2048/128) & 0xFF;
-      }
+    } else if ((pid >= PES_CODE_AUDIO)
+     && (pid < (PES_CODE_AUDIO + PES_NUMB_AUDIO))) {
+      a += 1;
     }
+    *d++ = pid;
+    d = put_bufferbound (d,pid,stream_bufferbound (t));
   }
   dest[PS_SYSTHD_AUDBND] = (a << 2)
        | 0 /* fixed_flag */
@@ -272,6 +374,123 @@ static int make_systemheader (stream_descr *s,
   return (i + PES_HEADER_SIZE);
 }
 
+/* Measure the output rate over the last PS_RATE_MSEC up to time now,
+ * and set mux_rate (in units of 50 byte/s) thereof.
+ * The rate is at least the average plus a margin, and at least the
+ * highest rate any push in the window needed to arrive completely
+ * before the next one was due. Without a sufficient window, keep the
+ * previous rate, or take the rate of a program stream source.
+ * A constant rate set with --muxrate is taken instead, as long as it
+ * suffices.
+ * On the first call, fix rate_bound to the constant rate if set, or else
+ * to that of a program stream source, or else to PS_RATE_BOUND. A
+ * mux_rate beyond rate_bound is warned about.
+ */
+static void measure_muxrate (stream_descr *s,
+    t_clock now)
+{
+  int k, n;
+  t_clock span;
+  int64_t r, p;
+  while ((rate_out != rate_in)
+      && ((now - rate_samples[rate_out].time)
+          > msec2clock (PS_RATE_MSEC))) {
+    rate_out = (rate_out + 1) % PS_RATE_SAMPLES;
+  }
+  if ((rate_out != rate_in)
+   && ((now - rate_samples[rate_out].time) < 0)) {
+    warn (LINF,"Rate reset",EPSC,6,0,rate_in - rate_out);
+    rate_out = rate_in;
+  }
+  r = 0;
+  if (rate_out != rate_in) {
+    span = now - rate_samples[rate_out].time;
+    if (span >= msec2clock (PS_RATE_MSEC / 8)) {
+      r = (out_bytes - rate_samples[rate_out].bytes) * CLOCK_HZ / span;
+      r += (r >> 3);
+      k = rate_out;
+      while (k != rate_in) {
+        n = (k + 1) % PS_RATE_SAMPLES;
+        if (n == rate_in) {
+          span = now - rate_samples[k].time;
+          p = out_bytes;
+        } else {
+          span = rate_samples[n].time - rate_samples[k].time;
+          p = rate_samples[n].bytes;
+        }
+        if (span > 0) {
+          p = (p - rate_samples[k].bytes) * CLOCK_HZ / span;
+          if (r < p) {
+            r = p;
+          }
+        }
+        k = n;
+      }
+      r = r / 50 + 1;
+    }
+  }
+  if (r > 0x3FFFFF) {
+    r = 0x3FFFFF;
+  }
+  if ((const_rate > 0)
+   && (r <= const_rate)) {
+    mux_rate = const_rate;
+  } else if (r > 0) {
+    mux_rate = r;
+  } else if (mux_rate <= 0) {
+    if ((s->fdescr->content == ct_program)
+     && (s->fdescr->u.ps.ph.muxrate > 0)) {
+      mux_rate = s->fdescr->u.ps.ph.muxrate;
+    } else {
+      mux_rate = PS_RATE_DEFAULT;
+    }
+  }
+  if (rate_bound <= 0) {
+    if (const_rate > 0) {
+      rate_bound = const_rate;
+    } else if ((s->fdescr->content == ct_program)
+     && (s->fdescr->u.ps.sh.ratebound > 0)) {
+      rate_bound = s->fdescr->u.ps.sh.ratebound;
+    } else {
+      rate_bound = PS_RATE_BOUND;
+    }
+  }
+  if (mux_rate > rate_bound) {
+    if (!rate_exceeded) {
+      warn (LWAR,"Rate bound exceeded",EPSC,6,1,mux_rate);
+      rate_exceeded = TRUE;
+    }
+  } else {
+    rate_exceeded = FALSE;
+  }
+}
+
+/* Check whether a PES due at time now may go into the last pack,
+ * i.e. whether its bytes arrive at the last pack's mux_rate not much
+ * earlier than they are due anyway. Otherwise, find the SCR for a new
+ * pack, which is now, or later if the last pack is not yet through.
+ * The SCR never goes back, so a time step back beyond the push jitter
+ * just starts a new pack.
+ * Return: TRUE, if no new pack header is needed
+ */
+static boolean pack_continues (t_clock now,
+    t_clock *scr)
+{
+  t_clock t;
+  *scr = now;
+  if (!pack_valid) {
+    return (FALSE);
+  }
+  t = pack_scr + (out_bytes - pack_bytes) * CLOCK_HZ / (pack_rate * 50);
+  if ((t - now) > 0) {
+    *scr = t;
+  }
+  return ((psi_size <= 0)
+       && ((now - pack_scr) >= -msec2clock (MAX_MSEC_PUSHJTTR))
+       && ((*scr - pack_scr) < msec2clock (MAX_MSEC_PCRDIST))
+       && ((t - now) >= -msec2clock (PS_MSEC_PACKDEV)));
+}
+
 static int make_streammap (stream_descr *s,
     byte *dest)
 {
@@ -357,22 +576,25 @@ stream_descr *process_something (stream_descr *s)
   byte *d;
   ctrl_buffer *c;
   clockref pcr;
-  int i;
-  t_msec now;
+  t_clock i, now, scr;
+  int l;
+  boolean pack;
   warn (LDEB,"Splice PS",EPSC,0,0,s->ctrl.out);
   if (s->streamdata == sd_map) {
     validate_mapref (s);
     return (NULL);
   }
   c = &s->ctrl.ptr[s->ctrl.out];
-  now = msec_now ();
+  now = clock_now ();
   if ((psi_frequency_changed)
    || ((psi_frequency_msec > 0)
     && ((next_psi_periodic - now) <= 0))) {
     prog.unchanged = TRUE;
     psi_frequency_changed = FALSE;
-    next_psi_periodic = now + psi_frequency_msec;
+    next_psi_periodic = now + msec2clock (psi_frequency_msec);
   }
+  i = c->clockpush + s->u.d.delta;
+  measure_muxrate (s,i);
   if (prog.unchanged || prog.changed) {
     if (prog.changed) {
       prog.pmt_version = (prog.pmt_version+1) & 0x1F;
@@ -382,41 +604,54 @@ stream_descr *process_something (stream_descr *s)
     prog.changed = FALSE;
     prog.unchanged = FALSE;
   }
-  i = c->msecpush + s->u.d.delta;
-  d = output_pushdata (PS_PACKHD_SIZE + psi_size + c->length, TRUE, i);
+  pack = !pack_continues (i,&scr);
+  l = (pack ? PS_PACKHD_SIZE : 0) + psi_size + c->length;
+  d = output_pushdata (l, TRUE, i);
   if (d == NULL) {
     return (s);
   }
-  *d++ = 0x00;
-  *d++ = 0x00;
-  *d++ = 0x01;
-  *d++ = PS_CODE_PACK_HDR;
-  msec2cref (&s->u.d.conv, i, &pcr);
-  *d++ = 0x40
-       | (((pcr.ba33 << 5) | (pcr.base >> 27)) & 0x38)
-       | 0x04
-       | ((pcr.base >> 28) & 0x03);
-  *d++ = (pcr.base >> 20);
-  *d++ = ((pcr.base >> 12) & 0xF8)
-       | 0x04
-       | ((pcr.base >> 13) & 0x03);
-  *d++ = (pcr.base >> 5);
-  *d++ = ((pcr.base << 3) & 0xF8)
-       | 0x04
-       | ((pcr.ext >> 7) & 0x03);
-  *d++ = (pcr.ext << 1)
-       | 0x01;
-  if (s->fdescr->content == ct_program) {
-    i = s->fdescr->u.ps.ph.muxrate; /* wrong, because maybe old */
-  } else {
-    i = 4500000 / 400; /* xxx wrong for sure */
+  if ((rate_in == rate_out)
+   || (rate_samples[(rate_in+PS_RATE_SAMPLES-1) % PS_RATE_SAMPLES].time
+       != i)) {
+    rate_samples[rate_in].time = i;
+    rate_samples[rate_in].bytes = out_bytes;
+    rate_in = (rate_in + 1) % PS_RATE_SAMPLES;
+    if (rate_in == rate_out) {
+      rate_out = (rate_out + 1) % PS_RATE_SAMPLES;
+    }
+  }
+  if (pack) {
+    pack_valid = TRUE;
+    pack_scr = scr;
+    pack_bytes = out_bytes;
+    pack_rate = mux_rate;
+    *d++ = 0x00;
+    *d++ = 0x00;
+    *d++ = 0x01;
+    *d++ = PS_CODE_PACK_HDR;
+    clock2cref (scr, &pcr);
+    *d++ = 0x40
+         | (((pcr.ba33 << 5) | (pcr.base >> 27)) & 0x38)
+         | 0x04
+         | ((pcr.base >> 28) & 0x03);
+    *d++ = (pcr.base >> 20);
+    *d++ = ((pcr.base >> 12) & 0xF8)
+         | 0x04
+         | ((pcr.base >> 13) & 0x03);
+    *d++ = (pcr.base >> 5);
+    *d++ = ((pcr.base << 3) & 0xF8)
+         | 0x04
+         | ((pcr.ext >> 7) & 0x03);
+    *d++ = (pcr.ext << 1)
+         | 0x01;
+    *d++ = (mux_rate >> 14);
+    *d++ = (mux_rate >> 6);
+    *d++ = (mux_rate << 2)
+         | 0x03;
+    *d++ = 0xF8
+         | 0; /* stuffing length */
   }
-  *d++ = (i >> 14);
-  *d++ = (i >> 6);
-  *d++ = (i << 2)
-       | 0x03;
-  *d++ = 0xF8
-       | 0; /* stuffing length */
+  out_bytes += l;
   if (psi_size > 0) {
     memcpy (d,&psi_data[0],psi_size);
     d += psi_size;
@@ -42,10 +42,15 @@
 #include "splice.h"
 #include "splicets.h"
 
+/* Programs that fit into the PAT section, besides the network pid:
+ */
+#define MAX_PATPROGS \
+  ((MAX_PSI_SECTION - TS_TRANSPORTID - 5 - CRC_SIZE - 4) / 4)
+
 const boolean splice_multipleprograms = TRUE;
 
 static boolean changed_pat;
-static boolean unchanged_pat;
+static boolean repeat_pat;
 static int pat_section;
 static const int last_patsection = 0;
 static byte nextpat_version;
@@ -53,42 +58,62 @@ static byte pat_conticnt;
 
 static int transportstreamid;
 
-static int psi_size;
-static int psi_done;
 static byte psi_data [MAX_PSI_SIZE];
+static psi_packets pat_packets;
+static psi_packets *psi_send;
+static int psi_sent;
 
 static byte unit_start;
 static byte *conticnt;
-static int psi_pid;
 static short network_pid = 0;
 
 static int progs;
-static prog_descr *prog [MAX_OUTPROG];
+static int prog_alloc;
+static prog_descr **prog;
+static prog_descr *prog_number [HASH_SIZE]; /* index by program_number */
 
 static int nextpid;
 static stream_descr *outs [MAX_STRPERTS];
 
 static stump_descr *globalstumps;
 
+/* Constant mux rate: slots of one TS packet each are counted in units of
+ * 1/(27MHz * muxrate), so that one slot is exactly CBR_SLOT units and
+ * the fraction of a 27MHz tick is cbr_sub / muxrate.
+ */
+#define CBR_SLOT ((int64_t)TS_PACKET_SIZE * 8 * CLOCK_HZ)
+
+static long muxrate;
+static boolean cbr_started;
+static t_clock cbr_clock;
+static int64_t cbr_sub;
+static t_clock cbr_pcrclock;
+
 boolean splice_specific_init (void)
 {
   progs = 0;
+  memset (prog_number,0,sizeof(prog_number));
   nextpid = 0;
   memset (outs,0,sizeof(outs));
   changed_pat = TRUE;
   pat_section = 0;
   nextpat_version = 0;
   pat_conticnt = 0;
-  psi_size = psi_done = 0;
+  pat_packets.packets = 0;
+  psi_send = NULL;
+  psi_sent = 0;
   unit_start = TS_UNIT_START;
   transportstreamid = 0x4227;
   globalstumps = NULL;
+  muxrate = 0;
+  cbr_started = FALSE;
   return (TRUE);
 }
 
 void splice_settransportstreamid (int tsid)
 {
   transportstreamid = tsid;
+  changed_pat = TRUE;
 }
 
 void splice_setpsifrequency (t_msec freq)
@@ -104,6 +129,15 @@ void splice_setnetworkpid (short pid)
   } else {
     network_pid = pid;
   }
+  changed_pat = TRUE;
+}
+
+void splice_setmuxrate (long rate)
+{
+  warn (LIMP,"Mux rate",ETSC,12,muxrate,rate);
+  muxrate = rate;
+  cbr_started = FALSE;
+  output_setmuxrate (rate);
 }
 
 static int findapid (stream_descr *s, int desire)
@@ -176,6 +210,7 @@ void splice_addsirange (file_descr *f,
       tssi->pid_low = lower;
       tssi->pid_high = upper;
       f->u.ts.tssi = tssi;
+      ts_file_pidchanged (f);
       r = upper; /* check for collision against existing PIDs, first sd_data */
       while (r >= lower) {
         stream_descr *s;
@@ -327,12 +362,13 @@ void splice_modifytargetdescriptor (int programnb,
 
 prog_descr *splice_getprog (int programnb)
 {
-  int i;
-  i = progs;
-  while (--i >= 0) {
-    if (prog[i]->program_number == programnb) {
-      return (prog[i]);
+  prog_descr *p;
+  p = prog_number[programnb & (HASH_SIZE - 1)];
+  while (p != NULL) {
+    if (p->program_number == programnb) {
+      return (p);
     }
+    p = p->hash_next;
   }
   return (NULL);
 }
@@ -344,7 +380,9 @@ prog_descr *splice_openprog (int programnb)
   warn (LIMP,"Open prog",ETSC,1,0,programnb);
   p = splice_getprog (programnb);
   if (p == NULL) {
-    if (progs < MAX_OUTPROG) {
+    if (progs >= MAX_PATPROGS) {
+      warn (LWAR,"PAT full",ETSC,1,3,progs);
+    } else if (table_reserve (&prog,&prog_alloc,progs + 1,sizeof (*prog))) {
       if ((pid = findapid (PMT_STREAM, -1)) > 0) {
         if ((p = malloc(sizeof(prog_descr))) != NULL) {
           p->program_number = programnb;
@@ -353,11 +391,18 @@ prog_descr *splice_openprog (int programnb)
           p->pmt_conticnt = 0;
           p->pmt_version = 0;
           p->changed = TRUE;
+          p->unchanged = FALSE;
+          p->repeat = FALSE;
+          p->pmt_packets.packets = 0;
           p->pat_section = 0; /* more ? */
           p->streams = 0;
+          p->stream_alloc = 0;
+          p->stream = NULL;
           p->stump = splice_getstumps (programnb,-1);
           clear_descrdescr (&p->manudescr);
           prog[progs++] = p;
+          p->hash_next = prog_number[programnb & (HASH_SIZE - 1)];
+          prog_number[programnb & (HASH_SIZE - 1)] = p;
           changed_pat = TRUE;
           configuration_changed = TRUE;
           splice_modifycheckmatch (programnb,p,NULL,NULL);
@@ -367,7 +412,7 @@ prog_descr *splice_openprog (int programnb)
         }
       }
     } else {
-      warn (LERR,"Max prog open",ETSC,1,2,0);
+      warn (LERR,"Alloc fail",ETSC,1,2,progs);
     }
   }
   return (p);
@@ -376,6 +421,7 @@ prog_descr *splice_openprog (int programnb)
 void splice_closeprog (prog_descr *p)
 {
   int i, n;
+  prog_descr **q;
   warn (LIMP,"Close prog",ETSC,3,0,p->program_number);
   configuration_changed = TRUE;
   while (p->streams > 0) {
@@ -395,9 +441,18 @@ void splice_closeprog (prog_descr *p)
   while (--i >= 0) {
     if (prog[i] == p) {
       prog[i] = prog[--progs];
+      q = &prog_number[p->program_number & (HASH_SIZE - 1)];
+      while (*q != p) {
+        q = &(*q)->hash_next;
+      }
+      *q = p->hash_next;
       if (n == 0) {
         outs[p->pmt_pid] = NULL;
       }
+      if (psi_send == &p->pmt_packets) {
+        psi_send = NULL;
+      }
+      free (p->stream);
       free (p);
       changed_pat = TRUE;
       return;
@@ -412,7 +467,8 @@ int splice_addstream (prog_descr *p,
 {
   int pid = 0;
   warn (LIMP,"Add stream",ETSC,4,force_sid,s->stream_id);
-  if (p->streams < MAX_STRPERPRG) {
+  if (table_reserve (&p->stream,&p->stream_alloc,
+        p->streams + 1,sizeof (*p->stream))) {
     pid = findapid (s,(s->fdescr->content == ct_transport) ? s->sourceid : -1);
     if (pid > 0) {
       if (!force_sid) {
@@ -456,6 +512,83 @@ void process_finish (void)
   warn (LIMP,"Finish",ETSC,6,0,0);
 }
 
+/* Reserve the next slot in the output at constant mux rate.
+ * Remember the slot position for PCR generation, then advance the slot.
+ * Precondition: muxrate>0, cbr_started.
+ * Return: Pointer to packet data, if available, NULL otherwise
+ */
+static byte *proccbr_nextslot (void)
+{
+  byte *d;
+  d = output_pushdata (TS_PACKET_SIZE, TRUE, cbr_clock);
+  if (d != NULL) {
+    cbr_pcrclock = cbr_clock;
+    cbr_sub += CBR_SLOT;
+    cbr_clock += cbr_sub / muxrate;
+    cbr_sub = cbr_sub % muxrate;
+  }
+  return (d);
+}
+
+/* Fill all slots before a given time with null packets.
+ * Precondition: muxrate>0, cbr_started.
+ * Return: TRUE, if done, FALSE if the output buffer is full
+ */
+static boolean proccbr_stuffing (t_clock upto)
+{
+  byte *d;
+  while (cbr_clock - upto < 0) {
+    if ((d = proccbr_nextslot ()) == NULL) {
+      return (FALSE);
+    }
+    warn (LDEB,"Splice null",ETSC,11,clock2msec (cbr_clock),upto);
+    *d++ = TS_SYNC_BYTE;
+    *d++ = TS_PID_NULL >> 8;
+    *d++ = (byte)TS_PID_NULL;
+    *d++ = TS_AFC_PAYLD;
+    memset (d,-1,TS_PACKET_SIZE-TS_PACKET_HEADSIZE);
+  }
+  return (TRUE);
+}
+
+/* Reserve space for one TS packet in the output buffer.
+ * With variable rate, this is just output_pushdata.
+ * With constant mux rate, the packet is placed in the next free slot,
+ * if timed, after the slots up to push have been stuffed.
+ * Return: Pointer to packet data, if available, NULL otherwise
+ */
+static byte *proc_pushpacket (boolean timed,
+    t_clock push)
+{
+  if (muxrate <= 0) {
+    return (output_pushdata (TS_PACKET_SIZE, timed, push));
+  }
+  if (!cbr_started) {
+    cbr_clock = timed ? push : clock_now ();
+    cbr_sub = 0;
+    cbr_started = TRUE;
+  }
+  if (timed) {
+    if (!proccbr_stuffing (push)) {
+      return (NULL);
+    }
+  }
+  return (proccbr_nextslot ());
+}
+
+void process_idle (void)
+{
+  if ((muxrate > 0)
+   && (cbr_started)) {
+    proccbr_stuffing (clock_now ());
+  }
+}
+
+/* Build a PAT section. Programs that do not fit into the section
+ * (as bounded by section_length) are left out, room is kept for the
+ * network pid, see splice_openprog.
+ * Return: size of the section
+ */
 static int make_patsection (int section,
     byte *dest)
 {
@@ -475,6 +608,10 @@ static int make_patsection (int section,
     p = prog[i];
     if (p->pat_section == section) {
       int x;
+      if (d + 4 > dest + MAX_PSI_SECTION - CRC_SIZE - 4) {
+        warn (LWAR,"PAT full",ETSC,14,1,p->program_number);
+        continue;
+      }
       x = p->program_number;
       *d++ = (x >> 8);
       *d++ = x;
@@ -496,15 +633,44 @@ static int make_patsection (int section,
   return (i + TS_TRANSPORTID);
 }
 
+/* Copy a descriptor to a PSI section being built, if it fits before end.
+ * Precondition: *d<=end
+ * Return: TRUE, if copied or void, FALSE if it does not fit
+ */
+static boolean put_sectiondescr (byte **d,
+    byte *y,
+    byte *end)
+{
+  int yl;
+  if (y != NULL) {
+    yl = y[1];
+    if (yl != 0) {
+      yl += 2;
+      if (*d + yl > end) {
+        return (FALSE);
+      }
+      memcpy (*d,y,yl);
+      *d += yl;
+    }
+  }
+  return (TRUE);
+}
+
+/* Build a PMT section. Descriptors and stream entries are put as long as
+ * they fit into the section (as bounded by section_length), the others are
+ * left out with a warning.
+ * Return: size of the section
+ */
 static int make_pmtsection (stream_descr *s,
     prog_descr *p,
     byte *dest)
 {
   int i;
-  byte *d;
+  byte *d, *end;
   stump_descr *st;
   stream_descr *t;
   d = dest;
+  end = dest + MAX_PSI_SECTION - CRC_SIZE;
   *d++ = TS_TABLEID_PMT;
   d += 2;
   i = p->program_number;
@@ -520,7 +686,7 @@ static int make_pmtsection (stream_descr *s,
       pcrs = s;
     }
     pcrs->u.d.has_clockref = TRUE;
-    pcrs->u.d.next_clockref = msec_now () - MAX_MSEC_PCRDIST;
+    pcrs->u.d.next_clockref = clock_now () - msec2clock (MAX_MSEC_PCRDIST);
     p->pcr_pid = pcrs->u.d.pid;
     configuration_changed = TRUE;
   }
@@ -536,13 +702,8 @@ static int make_pmtsection (stream_descr *s,
      && (s->u.d.mapstream != NULL)) {
       y = s->u.d.mapstream->autodescr->refx[i]; /* why this one? */
     }
-    if (y != NULL) {
-      int yl = y[1];
-      if (yl != 0) {
-        yl += 2;
-        memcpy (d,y,yl);
-        d += yl;
-      }
+    if (!put_sectiondescr (&d,y,end)) {
+      warn (LWAR,"PMT full",ETSC,14,2,p->program_number);
     }
   }
   i = d - dest - (TS_PMT_PILEN+2);
@@ -553,60 +714,62 @@ static int make_pmtsection (stream_descr *s,
     t = p->stream[i];
     if (t->u.d.mention) {
       int x;
-      byte *e;
-      *d++ = t->stream_type;
-      x = t->u.d.pid;
+      byte *e, *b;
+      boolean fits;
+      b = d;
+      fits = (d + 5 <= end);
+      if (fits) {
+        *d++ = t->stream_type;
+        x = t->u.d.pid;
+        *d++ = 0xE0 | (x >> 8);
+        *d++ = x;
+        d += 2;
+        e = d;
+        x = NUMBER_DESCR;
+        while (fits && (--x >= 0)) {
+          byte *y;
+          y = t->manudescr->refx[x];
+          if (y == NULL) {
+            y = t->autodescr->refx[x];
+          }
+          fits = put_sectiondescr (&d,y,end);
+        }
+        x = d - e;
+        *--e = x;
+        *--e = 0xF0 | (x >> 8);
+      }
+      if (!fits) {
+        warn (LWAR,"PMT full",ETSC,14,3,t->u.d.pid);
+        d = b;
+      }
+    }
+  }
+  st = p->stump;
+  while (st != NULL) {
+    int x;
+    byte *e, *b;
+    boolean fits;
+    b = d;
+    fits = (d + 5 <= end);
+    if (fits) {
+      *d++ = st->stream_type;
+      x = st->pid;
       *d++ = 0xE0 | (x >> 8);
       *d++ = x;
       d += 2;
       e = d;
       x = NUMBER_DESCR;
-      while (--x >= 0) {
-        byte *y;
-        y = t->manudescr->refx[x];
-        if (y == NULL) {
-          y = t->autodescr->refx[x];
-        }
-        if (y != NULL) {
-          int yl = y[1];
-          if (yl != 0) {
-            yl += 2;
-            memcpy (d,y,yl);
-            d += yl;
-          }
-        }
+      while (fits && (--x >= 0)) {
+        fits = put_sectiondescr (&d,st->manudescr.refx[x],end);
       }
       x = d - e;
       *--e = x;
       *--e = 0xF0 | (x >> 8);
     }
-  }
-  st = p->stump;
-  while (st != NULL) {
-    int x;
-    byte *e;
-    *d++ = st->stream_type;
-    x = st->pid;
-    *d++ = 0xE0 | (x >> 8);
-    *d++ = x;
-    d += 2;
-    e = d;
-    x = NUMBER_DESCR;
-    while (--x >= 0) {
-      byte *y;
-      y = st->manudescr.refx[x];
-      if (y != NULL) {
-        int yl = y[1];
-        if (yl != 0) {
-          yl += 2;
-          memcpy (d,y,yl);
-          d += yl;
-        }
-      }
+    if (!fits) {
+      warn (LWAR,"PMT full",ETSC,14,4,st->pid);
+      d = b;
     }
-    x = d - e;
-    *--e = x;
-    *--e = 0xF0 | (x >> 8);
     st = st->next;
   }
   i = d + CRC_SIZE - dest - TS_TRANSPORTID;
@@ -616,100 +779,140 @@ static int make_pmtsection (stream_descr *s,
   return (i + TS_TRANSPORTID);
 }
 
-/* Check for generated psi data to-be-sent, select data source.
- * If PAT or PMT needs to be rebuild, do so. If PAT or PMT is (partially)
- * pending to be transmitted, select that to be packaged next. Otherwise
- * select data payload. Set pid, scramble mode and PES paket size.
+/* Packetize a PSI section (preceded by the pointer field) the same way as
+ * procdata_syn_* would do, but leave the continuity counters zero, these
+ * are inserted on transmission.
+ * Precondition: q!=NULL, 0<size<=MAX_PSI_SIZE
+ */
+static void make_psipackets (psi_packets *q,
+    int pid,
+    byte *data,
+    int size)
+{
+  byte *d;
+  int payload;
+  q->packets = 0;
+  while (size > 0) {
+    d = &q->data[q->packets][0];
+    *d++ = TS_SYNC_BYTE;
+    *d++ = ((q->packets == 0) ? TS_UNIT_START : 0) | (pid >> 8);
+    *d++ = pid;
+    payload = TS_PACKET_SIZE - TS_PACKET_HEADSIZE;
+    if (size < payload) {
+      *d++ = TS_AFC_BOTH;
+      *d++ = (TS_PACKET_SIZE - TS_PACKET_FLAGS1) - size;
+      if (size < payload - 1) {
+        *d++ = 0;
+        memset (d,-1,payload - 2 - size);
+        d += payload - 2 - size;
+      }
+      payload = size;
+    } else {
+      *d++ = TS_AFC_PAYLD;
+    }
+    memcpy (d,data,payload);
+    data += payload;
+    size -= payload;
+    q->packets += 1;
+  }
+}
+
+/* Check for psi data to-be-sent, select data source.
+ * If PAT or PMT needs to be rebuild, do so. If it is just to be repeated,
+ * use the packets made before. If PAT or PMT is (partially) pending to be
+ * transmitted, select that to be sent next. Otherwise select data payload,
+ * set pid, scramble mode and PES paket size.
  * Precondition: s!=NULL, !list_empty(s->ctrl), s->streamdata==sd_data.
  * Input: stream s, current ctrl fifo out c. 
  * Output: *pid, *scramble, *size (PES paket ~) for the stream to generate.
+ * Return: TRUE, if psi_send is to be sent, FALSE for data.
  */
-static void procdata_check_psi (int *pid,
+static boolean procdata_check_psi (int *pid,
     byte *scramble,
     int *size,
     stream_descr *s,
     ctrl_buffer *c)
 {
-  t_msec now;
+  t_clock now;
   int i, l;
   prog_descr *p;
-  if (psi_size > 0) {
-    *pid = psi_pid;
-    *scramble = 0;
-    *size = psi_size;
-  } else {
-    if (unit_start != 0) {
-      now = msec_now ();
-      if ((psi_frequency_changed)
-       || ((psi_frequency_msec > 0)
-        && ((next_psi_periodic - now) <= 0))) {
-        unchanged_pat = TRUE;
-        l = progs;
-        while (--l >= 0) {
-          prog[l]->unchanged = TRUE;
-        }
-        psi_frequency_changed = FALSE;
-        next_psi_periodic = now + psi_frequency_msec;
+  if (psi_send != NULL) {
+    return (TRUE);
+  }
+  if (unit_start != 0) {
+    now = clock_now ();
+    if ((psi_frequency_changed)
+     || ((psi_frequency_msec > 0)
+      && ((next_psi_periodic - now) <= 0))) {
+      repeat_pat = TRUE;
+      l = progs;
+      while (--l >= 0) {
+        prog[l]->repeat = TRUE;
       }
-      if (unchanged_pat || changed_pat) {
-        psi_pid = TS_PID_PAT;
-        conticnt = &pat_conticnt;
-        psi_data[0] = 0;
+      psi_frequency_changed = FALSE;
+      next_psi_periodic = now + msec2clock (psi_frequency_msec);
+    }
+    if (repeat_pat || changed_pat) {
+      if (changed_pat || (pat_packets.packets == 0)) {
         if ((pat_section == 0)
          && (changed_pat)) {
           nextpat_version = (nextpat_version+1) & 0x1F;
         }
-        psi_size = make_patsection (pat_section,&psi_data[1]) + 1;
-        if (pat_section >= last_patsection) {
-          changed_pat = FALSE;
-          unchanged_pat = FALSE;
-          pat_section = 0;
-        } else {
-          pat_section += 1;
-        }
-        psi_done = 0;
-        *pid = psi_pid;
-        *scramble = 0;
-        *size = psi_size;
+        psi_data[0] = 0;
+        l = make_patsection (pat_section,&psi_data[1]) + 1;
+        make_psipackets (&pat_packets,TS_PID_PAT,&psi_data[0],l);
+      }
+      if (pat_section >= last_patsection) {
+        changed_pat = FALSE;
+        repeat_pat = FALSE;
+        pat_section = 0;
       } else {
-        l = s->u.d.progs;
-        while (--l >= 0) {
-          p = s->u.d.pdescr[l];
-          if (p->unchanged || p->changed) {
-            i = p->streams;
-            while ((--i >= 0)
-                && (!p->stream[i]->u.d.mention)) {
-            }
-            if (i >= 0) {
-              psi_pid = p->pmt_pid;
-              conticnt = &p->pmt_conticnt;
-              psi_data[0] = 0;
-              if (p->changed) {
-                p->pmt_version = (p->pmt_version+1) & 0x1F;
-              }
-              psi_size = make_pmtsection (s,p,&psi_data[1]) + 1;
-              p->changed = FALSE;
-              p->unchanged = FALSE;
-              psi_done = 0;
-              *pid = psi_pid;
-              *scramble = 0;
-              *size = psi_size;
-              return;
+        pat_section += 1;
+      }
+      conticnt = &pat_conticnt;
+      psi_send = &pat_packets;
+      psi_sent = 0;
+      return (TRUE);
+    }
+    l = s->u.d.progs;
+    while (--l >= 0) {
+      p = s->u.d.pdescr[l];
+      if (p->repeat || p->unchanged || p->changed) {
+        i = p->streams;
+        while ((--i >= 0)
+            && (!p->stream[i]->u.d.mention)) {
+        }
+        if (i >= 0) {
+          if (p->changed
+           || p->unchanged
+           || (p->pcr_pid < 0)
+           || (p->pmt_packets.packets == 0)) {
+            if (p->changed) {
+              p->pmt_version = (p->pmt_version+1) & 0x1F;
             }
+            psi_data[0] = 0;
+            i = make_pmtsection (s,p,&psi_data[1]) + 1;
+            make_psipackets (&p->pmt_packets,p->pmt_pid,&psi_data[0],i);
           }
+          p->changed = FALSE;
+          p->unchanged = FALSE;
+          p->repeat = FALSE;
+          conticnt = &p->pmt_conticnt;
+          psi_send = &p->pmt_packets;
+          psi_sent = 0;
+          return (TRUE);
         }
-        s->data.ptr[c->index+PES_STREAM_ID] = s->stream_id;
-        conticnt = &s->conticnt;
-        *pid = s->u.d.pid;
-        *scramble = c->scramble;
-        *size = c->length;
       }
-    } else {
-      *pid = s->u.d.pid;
-      *scramble = c->scramble;
-      *size = c->length;
     }
+    if (s->u.d.pass == PASS_NONE) {
+      s->data.ptr[c->index+PES_STREAM_ID] = s->stream_id;
+    }
+    conticnt = &s->conticnt;
   }
+  *pid = s->u.d.pid;
+  *scramble = c->scramble;
+  *size = c->length;
+  return (FALSE);
 }
 
 /* Check for adaption field items to be filled in.
@@ -732,8 +935,7 @@ static int procdata_adaptfield_flags (byte *adapt_flags1,
   *adapt_flags2 = 0;
   *adapt_flags1 = 0;
   space = TS_PACKET_SIZE - TS_PACKET_HEADSIZE;
-  if ((psi_size <= 0)
-   && (s->u.d.discontinuity)) { /* o, not for contents, but PCR-disco ? */
+  if (s->u.d.discontinuity) { /* o, not for contents, but PCR-disco ? */
     s->u.d.discontinuity = FALSE;
     *adapt_flags1 |= TS_ADAPT_DISCONTI;
   }
@@ -743,17 +945,15 @@ static int procdata_adaptfield_flags (byte *adapt_flags1,
   if (0) {
     *adapt_flags1 |= TS_ADAPT_PRIORITY;
   }
-  if ((psi_size <= 0)
-   && (s->u.d.has_clockref)
+  if ((s->u.d.has_clockref)
    && ((c->pcr.valid)
-    || (s->u.d.next_clockref - (c->msecpush + s->u.d.delta) <= 0))) {
+    || (s->u.d.next_clockref - (c->clockpush + s->u.d.delta) <= 0))) {
     *adapt_flags1 |= TS_ADAPT_PCRFLAG;
     space -= 6;
   }
-  if ((psi_size <= 0)
-   && ((c->opcr.valid)
-    || ((!s->u.d.has_opcr)
-     && (c->pcr.valid)))) {
+  if ((c->opcr.valid)
+   || ((!s->u.d.has_opcr)
+    && (c->pcr.valid))) {
     *adapt_flags1 |= TS_ADAPT_OPCRFLAG;
     space -= 6;
   }
@@ -853,6 +1053,29 @@ static byte *procdata_syn_head (byte *d,
   return (d);
 }
 
+/* Generate a PCR for the packet pushed last.
+ * With constant mux rate, the time of its slot is used, otherwise push.
+ * Precondition: d!=NULL (data destination).
+ * Return: d (increased by PCR size).
+ */
+static byte *proc_syn_pcr (byte *d,
+    t_clock push)
+{
+  clockref pcr;
+  if (muxrate > 0) {
+    clock2cref (cbr_pcrclock, &pcr);
+  } else {
+    clock2cref (push, &pcr);
+  }
+  *d++ = (pcr.base >> 25) | (pcr.ba33 << 7);
+  *d++ = pcr.base >> 17;
+  *d++ = pcr.base >> 9;
+  *d++ = pcr.base >> 1;
+  *d++ = (pcr.base << 7) | (pcr.ext >> 8) | 0x7E;
+  *d++ = pcr.ext;
+  return (d);
+}
+
 /* Generate adpation field.
  * This MUST match the calculations in procdata_adaptfield_flags.
  * Precondition: s!=NULL.
@@ -875,16 +1098,9 @@ static byte *procdata_syn_adaptfield (stream_descr *s,
     if ((*d++ = (TS_PACKET_SIZE - TS_PACKET_FLAGS1) - payload) != 0) {
       *d++ = adapt_flags1;
       if (adapt_flags1 & TS_ADAPT_PCRFLAG) {
-        clockref pcr;
-        msec2cref (&s->u.d.conv, c->msecpush + s->u.d.delta, &pcr);
-        *d++ = (pcr.base >> 25) | (pcr.ba33 << 7);
-        *d++ = pcr.base >> 17;
-        *d++ = pcr.base >> 9;
-        *d++ = pcr.base >> 1;
-        *d++ = (pcr.base << 7) | (pcr.ext >> 8) | 0x7E;
-        *d++ = pcr.ext;
+        d = proc_syn_pcr (d,c->clockpush + s->u.d.delta);
         s->u.d.next_clockref =
-          (c->msecpush + s->u.d.delta) + MAX_MSEC_PCRDIST;
+          (c->clockpush + s->u.d.delta) + msec2clock (MAX_MSEC_PCRDIST);
         c->pcr.valid = FALSE;
       }
       if (adapt_flags1 & TS_ADAPT_OPCRFLAG) {
@@ -927,8 +1143,8 @@ static byte *procdata_syn_adaptfield (stream_descr *s,
 }
 
 /* Generate payload portion.
- * Insert the appropriate payload (either PSI or data), check whether payload
- * from this PES packet or section is left.
+ * Leave the data payload to the output by reference, check whether
+ * payload from this PES packet is left.
  * Precondition: s!=NULL.
  * Input: s (stream), c (current ctrl fifo out), d (data destination),
  *   payload (number of payload bytes to insert).
@@ -940,42 +1156,116 @@ static stream_descr *procdata_syn_payload (stream_descr *s,
     byte *d,
     int payload)
 {
+  byte *y;
   if (payload > 0) {
-    if (psi_size > 0) {
-      memcpy (d,&psi_data[psi_done],payload);
-      if (payload < psi_size) {
-        warn (LSEC,"Splice PSI Data",ETSC,9,s->stream_id,payload);
-        psi_done += payload;
-        psi_size -= payload;
-        unit_start = 0;
-      } else {
-        warn (LINF,"Splice PSI Done",ETSC,9,s->stream_id,payload);
-        psi_done = psi_size = 0;
-        unit_start = TS_UNIT_START;
-      }
+    y = &s->data.ptr[c->index];
+    if (payload < c->length) {
+      warn (LSEC,"Splice Data",ETSC,9,s->stream_id,payload);
+      c->length -= payload;
+      s->u.d.outdone = (c->index += payload);
+      output_reference (d,s,y,payload);
+      unit_start = 0;
     } else {
-      memcpy (d,&s->data.ptr[c->index],payload);
-      if (payload < c->length) {
-        warn (LSEC,"Splice Data",ETSC,9,s->stream_id,payload);
-        c->length -= payload;
-        s->data.out = (c->index += payload);
-        unit_start = 0;
+      warn (LINF,"Splice Done",ETSC,9,s->stream_id,payload);
+      list_incr (s->ctrl.out,s->ctrl,1);
+      if (list_empty (s->ctrl)) {
+        s->u.d.outdone = s->data.in;
       } else {
-        warn (LINF,"Splice Done",ETSC,9,s->stream_id,payload);
-        list_incr (s->ctrl.out,s->ctrl,1);
-        if (list_empty (s->ctrl)) {
-          s->data.out = s->data.in;
-        } else {
-          s->data.out = s->ctrl.ptr[s->ctrl.out].index;
-        }
-        unit_start = TS_UNIT_START;
-        return (NULL);
+        s->u.d.outdone = s->ctrl.ptr[s->ctrl.out].index;
       }
+      output_reference (d,s,y,payload);
+      unit_start = TS_UNIT_START;
+      return (NULL);
     }
   }
   return (s);
 }
 
+/* Pass a TS packet of a stream in passthrough mode.
+ * Only PID and continuity counter are rewritten, the PCR is restamped
+ * if so requested. If the stream carries the PCR of its program and a
+ * PCR is due for restamping, but the packet has none, an adaption field
+ * only packet with the PCR is sent first.
+ * Precondition: s!=NULL, !list_empty(s->ctrl), s->u.d.pass!=PASS_NONE.
+ * Input: s (stream), c (current ctrl fifo out).
+ * Return: s, if the packet is still to be sent, NULL otherwise.
+ */
+static stream_descr *procpass_packet (stream_descr *s,
+    ctrl_buffer *c)
+{
+  byte *d, *y;
+  int h;
+  t_clock t;
+  boolean pcr;
+  t = c->clockpush + s->u.d.delta;
+  d = proc_pushpacket (TRUE, t);
+  if (d == NULL) {
+    return (s);
+  }
+  y = &s->data.ptr[c->index];
+  pcr = ((y[TS_PACKET_CONTICNT] & TS_AFC_ADAPT)
+      && (y[TS_PACKET_ADAPTLEN] >= 7)
+      && (y[TS_PACKET_FLAGS1] & TS_ADAPT_PCRFLAG));
+  *d++ = TS_SYNC_BYTE;
+  if ((s->u.d.pass == PASS_RESTAMP)
+   && (s->u.d.has_clockref)
+   && (!pcr)
+   && (s->u.d.next_clockref - t <= 0)) {
+    warn (LSEC,"Pass PCR",ETSC,13,1,s->u.d.pid);
+    *d++ = s->u.d.pid >> 8;
+    *d++ = s->u.d.pid;
+    *d++ = TS_AFC_ADAPT | ((s->conticnt - 1) & 0x0F);
+    *d++ = TS_PACKET_SIZE - TS_PACKET_FLAGS1;
+    *d++ = TS_ADAPT_PCRFLAG;
+    d = proc_syn_pcr (d,t);
+    memset (d,-1,TS_PACKET_SIZE - TS_PACKET_FLAGS1 - 7);
+    s->u.d.next_clockref = t + msec2clock (MAX_MSEC_PCRDIST);
+    return (s);
+  }
+  *d++ = (y[TS_PACKET_PID] & 0xE0) | (s->u.d.pid >> 8);
+  *d++ = s->u.d.pid;
+  if (y[TS_PACKET_CONTICNT] & TS_AFC_PAYLD) {
+    *d++ = (y[TS_PACKET_CONTICNT] & 0xF0) | s->conticnt;
+    s->conticnt = (s->conticnt+1) & 0x0F;
+  } else {
+    *d++ = (y[TS_PACKET_CONTICNT] & 0xF0) | ((s->conticnt - 1) & 0x0F);
+  }
+  h = TS_PACKET_HEADSIZE;
+  if ((s->u.d.pass == PASS_RESTAMP)
+   && (pcr)) {
+    warn (LSEC,"Pass PCR",ETSC,13,2,s->u.d.pid);
+    *d++ = y[TS_PACKET_ADAPTLEN];
+    *d++ = y[TS_PACKET_FLAGS1];
+    d = proc_syn_pcr (d,t);
+    s->u.d.next_clockref = t + msec2clock (MAX_MSEC_PCRDIST);
+    h = TS_PACKET_FLAGS1 + 7;
+  }
+  list_incr (s->ctrl.out,s->ctrl,1);
+  if (list_empty (s->ctrl)) {
+    s->u.d.outdone = s->data.in;
+  } else {
+    s->u.d.outdone = s->ctrl.ptr[s->ctrl.out].index;
+  }
+  output_reference (d,s,&y[h],TS_PACKET_SIZE - h);
+  return (NULL);
+}
+
+/* Copy the next packet of the pending PSI section to the output,
+ * and insert the continuity counter.
+ * Precondition: psi_send!=NULL, d!=NULL.
+ */
+static void procdata_psipacket (byte *d)
+{
+  memcpy (d,&psi_send->data[psi_sent][0],TS_PACKET_SIZE);
+  d[TS_PACKET_CONTICNT] |= *conticnt;
+  warn (LSEC,"Splice continuity cnt",ETSC,7,3,*conticnt);
+  *conticnt = (*conticnt+1) & 0x0F;
+  if (++psi_sent >= psi_send->packets) {
+    warn (LINF,"Splice PSI Done",ETSC,9,psi_sent,psi_send->packets);
+    psi_send = NULL;
+  }
+}
+
 /* Process unparsed si data and generate output.
  * Take one TS paket, copy it to output stream data buffer.
  * Precondition: s!=NULL, !list_empty(s->ctrl), s->streamdata==sd_unparsedsi,
@@ -1012,8 +1302,17 @@ stream_descr *process_something (stream_descr *s)
   switch (s->streamdata) {
     case sd_data:
       c = &s->ctrl.ptr[s->ctrl.out];
-      procdata_check_psi (&pid, &scramble, &size, s, c);
-      d = output_pushdata (TS_PACKET_SIZE, TRUE, c->msecpush + s->u.d.delta);
+      if (procdata_check_psi (&pid, &scramble, &size, s, c)) {
+        d = proc_pushpacket (TRUE, c->clockpush + s->u.d.delta);
+        if (d != NULL) {
+          procdata_psipacket (d);
+        }
+        return (s);
+      }
+      if (s->u.d.pass != PASS_NONE) {
+        return (procpass_packet (s, c));
+      }
+      d = proc_pushpacket (TRUE, c->clockpush + s->u.d.delta);
       if (d == NULL) {
         return (s);
       }
@@ -1032,7 +1331,7 @@ stream_descr *process_something (stream_descr *s)
       break;
     case sd_unparsedsi:
       c = &s->ctrl.ptr[s->ctrl.out];
-      d = output_pushdata (TS_PACKET_SIZE, FALSE, 0);
+      d = proc_pushpacket (FALSE, 0);
       if (d == NULL) {
         return (s);
       }
@@ -28,6 +28,11 @@
  * format.
  */
 
+#if defined (__AVX2__)
+#include <immintrin.h>
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "global.h"
 #include "error.h"
 #include "pes.h"
@@ -67,34 +72,115 @@ int guess_streamtype (int streamid)
   }
 }
 
+/* Find the first PES/PS stream prefix in a contiguous block.
+ * Compare 16 or 32 positions at a time if SSE2 or AVX2 is available
+ * at compile time, the rest is done byte by byte.
+ * Precondition: d!=NULL, l>=0
+ * Return: offset of the prefix, if it is completely within the block,
+ *         -1 otherwise.
+ */
+static int pes_find_prefix (byte *d,
+    int l)
+{
+  int i;
+  i = 0;
+#if defined (__AVX2__)
+  {
+    unsigned int m;
+    __m256i zero, one, x0, x1, x2;
+    zero = _mm256_setzero_si256 ();
+    one = _mm256_set1_epi8 (0x01);
+    while (i + 2 + 32 <= l) {
+      x0 = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((__m256i *)&d[i]),zero);
+      x1 = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((__m256i *)&d[i+1]),zero);
+      x2 = _mm256_cmpeq_epi8 (_mm256_loadu_si256 ((__m256i *)&d[i+2]),one);
+      m = _mm256_movemask_epi8 (_mm256_and_si256 (_mm256_and_si256 (x0,x1),x2));
+      if (m != 0) {
+        return (i + __builtin_ctz (m));
+      }
+      i += 32;
+    }
+  }
+#endif
+#if defined (__SSE2__)
+  {
+    unsigned int m;
+    __m128i zero, one, x0, x1, x2;
+    zero = _mm_setzero_si128 ();
+    one = _mm_set1_epi8 (0x01);
+    while (i + 2 + 16 <= l) {
+      x0 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((__m128i *)&d[i]),zero);
+      x1 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((__m128i *)&d[i+1]),zero);
+      x2 = _mm_cmpeq_epi8 (_mm_loadu_si128 ((__m128i *)&d[i+2]),one);
+      m = _mm_movemask_epi8 (_mm_and_si128 (_mm_and_si128 (x0,x1),x2));
+      if (m != 0) {
+        return (i + __builtin_ctz (m));
+      }
+      i += 16;
+    }
+  }
+#endif
+  while (i + 2 < l) {
+    if (d[i+2] > 0x01) {
+      i += 3;
+    } else if ((d[i+2] == 0x01)
+            && (d[i+1] == 0x00)
+            && (d[i] == 0x00)) {
+      return (i);
+    } else {
+      i += 1;
+    }
+  }
+  return (-1);
+}
+
 /* Skip to find a PES/PS stream prefix
+ * The raw data buffer is searched in its two contiguous parts, a prefix
+ * that crosses the end of the buffer is checked separately.
  * Precondition: f!=NULL
  * Postcondition: if found: f->data.out indicates the prefix.
  * Return: TRUE, if found, FALSE otherwise.
  */
 boolean pes_skip_to_prefix (file_descr *f)
 {
-  int i, l, k, n;
-  byte d;
-  l = k = list_size (f->data);
-  i = f->data.out;
-  n = 1;
-  d = f->data.ptr[i];
-  while ((--l > 0)
-      && ((n >= 0)
-       || (d != 0x01))) {
-    list_incr (i,f->data,1);
-    if (d) n = 1; else n -= 1;
-    d = f->data.ptr[i];
-  }
-  k = k - l - PES_SYNC_SIZE;
+  int l, k, n;
+  byte *d;
+  boolean found;
+  d = f->data.ptr;
+  l = list_size (f->data);
+  n = f->data.mask + 1 - f->data.out;
+  if (n > l) {
+    n = l;
+  }
+  k = pes_find_prefix (&d[f->data.out],n);
+  if ((k < 0)
+   && (n < l)) {
+    k = (n > 2) ? n - 2 : 0;
+    while ((k < n)
+        && ((k + 2 >= l)
+         || (d[(f->data.out + k) & f->data.mask] != 0x00)
+         || (d[(f->data.out + k + 1) & f->data.mask] != 0x00)
+         || (d[(f->data.out + k + 2) & f->data.mask] != 0x01))) {
+      k += 1;
+    }
+    if (k >= n) {
+      k = pes_find_prefix (&d[0],l - n);
+      if (k >= 0) {
+        k += n;
+      }
+    }
+  }
+  found = (k >= 0);
+  if (!found) {
+    k = l - PES_SYNC_SIZE;
+  }
   if (k > 0) {
     warn (LWAR,"Skipped",EPES,1,1,k);
     f->skipped += k; /* evaluate: skip > good and skip > CONST -> bad */
     f->total += k;
     list_incr (f->data.out,f->data,k);
   }
-  return ((n < 0) && (d == 0x01));
+  return (found);
 }
 
 /* Determine the stream id of a packet.
@@ -151,7 +237,7 @@ int pes_transfer (refr_data *src,
   }
   r = dst->in;
   while (size > 0) {
-    l = MAX_DATA_RAWB - src->out;
+    l = src->mask + 1 - src->out;
     if (l > size) {
       l = size;
     }
@@ -164,6 +250,110 @@ int pes_transfer (refr_data *src,
   return (r);
 }
 
+/* Read a PTS or DTS from the raw input buffer.
+ * Precondition: f!=NULL, 5 bytes of data at offset i from f->data.out
+ */
+static void pes_timestamp (file_descr *f,
+    int i,
+    clockref *t)
+{
+  uint32_t x;
+  byte a;
+  i = (f->data.out + i) & f->data.mask;
+  a = f->data.ptr[i];
+  marker_bit (a,0);
+  t->ba33 = (a >> 3) & 1;
+  x = a & 0x06;
+  list_incr (i,f->data,1);
+  x = (x << 7) | f->data.ptr[i];
+  list_incr (i,f->data,1);
+  a = f->data.ptr[i];
+  marker_bit (a,0);
+  x = (x << 8) | (a & 0xFE);
+  list_incr (i,f->data,1);
+  x = (x << 7) | f->data.ptr[i];
+  list_incr (i,f->data,1);
+  a = f->data.ptr[i];
+  marker_bit (a,0);
+  t->base = (x << 7) | (a >> 1);
+  t->ext = 0;
+  t->valid = TRUE;
+}
+
+/* Evaluate the time stamps of the PES packet at f->data.out.
+ * The DTS, or the PTS if there is no DTS, is converted to internal time
+ * via the conversion base of the file, which also copes with wrapping.
+ * A packet without time stamp keeps the time of the previous one.
+ * Both ISO 13818 and ISO 11172 headers are understood.
+ * Precondition: f!=NULL, the complete packet of size q is available,
+ * p is its stream id
+ * Postcondition: if any time stamp was found so far: f->u.pes.timed,
+ * f->u.pes.clocktime is the push time of the packet.
+ */
+static void pes_evaltime (file_descr *f,
+    int p,
+    int q)
+{
+  clockref t;
+  int i, h;
+  byte a, flags;
+  t.valid = FALSE;
+  switch (p) {
+    case PES_CODE_STR_MAP:
+    case PES_CODE_PADDING:
+    case PES_CODE_PRIVATE2:
+    case PES_CODE_ECM:
+    case PES_CODE_EMM:
+    case PES_CODE_DSMCC:
+    case PES_CODE_ITU222E:
+    case PES_CODE_STR_DIR:
+      break;
+    default:
+      i = PES_HEADER_SIZE;
+      if (i >= q) {
+        break;
+      }
+      a = f->data.ptr[(f->data.out + i) & f->data.mask];
+      if ((a & 0xC0) == 0x80) {
+        if (i + 3 + 5 <= q) {
+          flags = f->data.ptr[(f->data.out + i + 1) & f->data.mask] >> 6;
+          h = f->data.ptr[(f->data.out + i + 2) & f->data.mask];
+          i += 3;
+          if ((flags == 3)
+           && (h >= 10)
+           && (i + 10 <= q)) {
+            pes_timestamp (f,i+5,&t);
+          } else if ((flags & 2)
+                  && (h >= 5)) {
+            pes_timestamp (f,i,&t);
+          }
+        }
+      } else {
+        while ((a == 0xFF)
+            && (i < PES_HEADER_SIZE + 16)
+            && (i + 1 < q)) {
+          i += 1;
+          a = f->data.ptr[(f->data.out + i) & f->data.mask];
+        }
+        if (((a & 0xC0) == 0x40)
+         && (i + 2 < q)) {
+          i += 2;
+          a = f->data.ptr[(f->data.out + i) & f->data.mask];
+        }
+        if (((a & 0xE0) == 0x20)
+         && (i + ((a & 0x10) ? 10 : 5) <= q)) {
+          pes_timestamp (f,(a & 0x10) ? i + 5 : i,&t);
+        }
+      }
+      break;
+  }
+  if (t.valid) {
+    warn (LINF,"PTS/DTS",EPES,5,t.ba33,t.base);
+    cref2clock (&f->u.pes.conv,t,&f->u.pes.clocktime);
+    f->u.pes.timed = TRUE;
+  }
+}
+
 /* Split data from a PES stream.
  * Precondition: f!=NULL
  * Return: TRUE, if something was processed, FALSE if no data/space available
@@ -205,26 +395,27 @@ boolean split_pes (file_descr *f)
           q += PES_HEADER_SIZE;
           if (l >= q) {
             if (p == s->stream_id) {
-              if (list_free (s->data) >= 2*q-1) {
+              if ((!list_full (s->ctrl))
+               && (list_free (s->data) >= 2*q-1)) {
                 c = &s->ctrl.ptr[s->ctrl.in];
                 c->length = q;
+                pes_evaltime (f,p,q);
                 f->payload += q;
                 f->total += q;
+                input_splitdone (s,q);
                 c->index = pes_transfer (&f->data,&s->data,q);
                 warn (LDEB,"Sequence",EPES,0,1,f->sequence);
                 c->sequence = f->sequence++;
                 c->scramble = 0;
-                c->msecread = msec_now ();
-                if (S_ISREG (f->st_mode)) {
-                  c->msecpush = c->msecread; /* wrong, but how ? */
-                } else {
-                  c->msecpush = c->msecread; /* enough ? */
-                }
+                c->clockread = input_clockread (f);
+                c->clockpush = f->u.pes.timed ? f->u.pes.clocktime
+                                              : c->clockread;
                 c->pcr.valid = FALSE;
                 c->opcr.valid = FALSE;
                 list_incr (s->ctrl.in,s->ctrl,1);
                 return (TRUE);
               }
+              input_splitwanted (s,q);
             } else {
               warn (LDEB,"Dropped PES Packet",EPES,0,p,q);
               f->skipped += q;
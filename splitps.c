@@ -95,10 +95,10 @@ static int ps_pack_header (file_descr *f,
   f->u.ps.ph.scr.ext = ((a & 0x03) << 7) | (b >> 1);
   warn (LSEC,"SCR ext",EPST,2,4,f->u.ps.ph.scr.ext);
   f->u.ps.ph.scr.valid = TRUE;
-  cref2msec (&f->u.ps.stream[0]->u.m.conv,
+  cref2clock (&f->u.ps.stream[0]->u.m.conv,
       f->u.ps.ph.scr,
-      &f->u.ps.stream[0]->u.m.msectime);
-  warn (LDEB,"(map time)",EPST,2,5,f->u.ps.stream[0]->u.m.msectime);
+      &f->u.ps.stream[0]->u.m.clocktime);
+  warn (LDEB,"(map time)",EPST,2,5,f->u.ps.stream[0]->u.m.clocktime);
   list_incr (i,f->data,1);
   x = f->data.ptr[i] << 8;
   list_incr (i,f->data,1);
@@ -434,17 +434,19 @@ static boolean ps_data_stream (file_descr *f,
       c->length = size;
       f->payload += size;
       f->total += size;
+      input_splitdone (s,size);
       c->index = pes_transfer (&f->data,&s->data,size);
       warn (LDEB,"Sequence",EPST,6,1,f->sequence);
       c->sequence = f->sequence++;
       c->scramble = 0;
-      c->msecread = msec_now ();
-      c->msecpush = f->u.ps.stream[0]->u.m.msectime;
+      c->clockread = input_clockread (f);
+      c->clockpush = f->u.ps.stream[0]->u.m.clocktime;
       c->pcr.valid = FALSE;
       c->opcr.valid = FALSE;
       list_incr (s->ctrl.in,s->ctrl,1);
       return (TRUE);
     }
+    input_splitwanted (s,size);
     return (FALSE);
   }
   f->total += size;
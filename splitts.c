@@ -28,6 +28,11 @@
  * mapstreams.
  */
 
+#if defined (__AVX2__)
+#include <immintrin.h>
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "global.h"
 #include "error.h"
 #include "input.h"
@@ -39,63 +44,227 @@
 #include "splitts.h"
 #include "crc32.h"
 
-static byte pusi, afcc, afflg1;
-static int paylen;
+/* per thread, as different files may be split concurrently: */
+static __thread byte pusi, afcc, afflg1;
+static __thread int paylen;
+static __thread byte *tspacket;
+static __thread byte tswrap[TS_PACKET_SIZE];
+static __thread boolean dataonly; /* see split_ts_parallel */
 
-/* Skip in input raw data buffer for TS-syncbyte.
+/* Find the first TS sync byte in a contiguous block.
+ * Compare 16 or 32 positions at a time if SSE2 or AVX2 is available
+ * at compile time, the rest is done byte by byte.
+ * Precondition: d!=NULL, l>=0
+ * Return: offset of the sync byte, -1 if none found.
+ */
+static int ts_find_syncbyte (byte *d,
+    int l)
+{
+  int i;
+  i = 0;
+#if defined (__AVX2__)
+  {
+    unsigned int m;
+    __m256i sync;
+    sync = _mm256_set1_epi8 (TS_SYNC_BYTE);
+    while (i + 32 <= l) {
+      m = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (
+            _mm256_loadu_si256 ((__m256i *)&d[i]),sync));
+      if (m != 0) {
+        return (i + __builtin_ctz (m));
+      }
+      i += 32;
+    }
+  }
+#endif
+#if defined (__SSE2__)
+  {
+    unsigned int m;
+    __m128i sync;
+    sync = _mm_set1_epi8 (TS_SYNC_BYTE);
+    while (i + 16 <= l) {
+      m = _mm_movemask_epi8 (_mm_cmpeq_epi8 (
+            _mm_loadu_si128 ((__m128i *)&d[i]),sync));
+      if (m != 0) {
+        return (i + __builtin_ctz (m));
+      }
+      i += 16;
+    }
+  }
+#endif
+  while (i < l) {
+    if (d[i] == TS_SYNC_BYTE) {
+      return (i);
+    }
+    i += 1;
+  }
+  return (-1);
+}
+
+/* Check whether a sync byte candidate is followed by further sync bytes
+ * at a stride of 188, 192 (M2TS) or 204 (RS) bytes. TS_LOCK_PACKETS
+ * sync bytes in a row are needed, less only if the input has ended.
+ * Precondition: f!=NULL, 0<=k<l<=list_size(f->data),
+ * k is the offset of the candidate from f->data.out
+ * Return: the stride, if confirmed, 0 if not, -1 if more data is needed
+ */
+static int ts_confirm_stride (file_descr *f,
+    int k,
+    int l)
+{
+  static const int stride[] = {TS_PACKET_SIZE,TS_STRIDE_M2TS,TS_STRIDE_RS};
+  int i, j, r;
+  r = 0;
+  i = 0;
+  while (i < sizeof(stride)/sizeof(stride[0])) {
+    j = 1;
+    while ((j < TS_LOCK_PACKETS)
+        && (k + j * stride[i] < l)
+        && (f->data.ptr[(f->data.out + k + j * stride[i]) & f->data.mask]
+              == TS_SYNC_BYTE)) {
+      j += 1;
+    }
+    if (j >= TS_LOCK_PACKETS) {
+      return (stride[i]);
+    }
+    if (k + j * stride[i] >= l) {
+      if (f->handle < 0) {
+        return (stride[i]);
+      }
+      r = -1;
+    }
+    i += 1;
+  }
+  return (r);
+}
+
+/* Skip in input raw data buffer to get in sync with the TS packets.
+ * Once in sync, only the sync bytes of each packet and of the next one,
+ * if already available, are checked, so that garbage is not taken for a
+ * packet just because it starts with a sync byte. Otherwise
+ * the sync byte candidates are searched in bulk, in the two contiguous
+ * parts of the buffer, and sync is gained on the first candidate that
+ * is confirmed by ts_confirm_stride.
  * Precondition: f!=NULL
- * Postcondition: if found: f->data.out indicates the syncbyte.
- * Return: TRUE if found, FALSE otherwise
+ * Postcondition: if in sync: f->u.ts.stride is the packet stride, and
+ * f->data.out indicates the start of a packet, i.e. the syncbyte or
+ * the time stamp ahead of it.
+ * Return: TRUE if in sync and a complete packet is available,
+ *         FALSE otherwise
  */
 static boolean ts_skip_to_syncbyte (file_descr *f)
 {
-  int i, l, k;
-  boolean r = FALSE;
-  l = k = list_size (f->data);
-  i = f->data.out;
-  while ((l > 0)
-      && ((f->data.ptr[i] != TS_SYNC_BYTE) || (r = TRUE, FALSE))) {
-    list_incr (i,f->data,1);
-    l -= 1;
-  }
-  k -= l;
+  int c, k, l, n, s;
+  boolean wait;
+  l = list_size (f->data);
+  s = f->u.ts.stride;
+  if (s > 0) {
+    if (l < s) {
+      return (FALSE);
+    }
+    n = f->data.out + ts_stride_head (s);
+    if ((f->data.ptr[n & f->data.mask] == TS_SYNC_BYTE)
+     && ((l <= s + ts_stride_head (s))
+      || (f->data.ptr[(n + s) & f->data.mask] == TS_SYNC_BYTE))) {
+      return (TRUE);
+    }
+    warn (LWAR,"Sync lost",ETST,1,2,s);
+    f->u.ts.stride = s = 0;
+    f->u.ts.syncunlocks += 1;
+  }
+  n = f->data.mask + 1 - f->data.out;
+  k = 0;
+  wait = FALSE;
+  while ((s == 0) && !wait && (k < l)) {
+    c = -1;
+    if (k < n) {
+      c = ts_find_syncbyte (&f->data.ptr[f->data.out + k],mmin(n,l) - k);
+      if (c >= 0) {
+        c += k;
+      } else {
+        k = n;
+      }
+    }
+    if ((c < 0) && (k < l)) {
+      c = ts_find_syncbyte (&f->data.ptr[(f->data.out + k) & f->data.mask],
+          l - k);
+      if (c >= 0) {
+        c += k;
+      }
+    }
+    if (c < 0) {
+      k = l;
+    } else if ((s = ts_confirm_stride (f,c,l)) < 0) {
+      s = 0;
+      k = c;
+      wait = TRUE;
+    } else if (s == 0) {
+      k = c + 1;
+    } else {
+      k = (c >= ts_stride_head (s)) ? c - ts_stride_head (s)
+        : mmin(c + s - ts_stride_head (s),l);
+    }
+  }
   if (k > 0) {
     warn (LWAR,"Skipped",ETST,1,1,k);
     f->skipped += k;
     f->total += k;
     list_incr (f->data.out,f->data,k);
   }
-  return (r);
+  if (s > 0) {
+    warn (LINF,"Sync",ETST,1,3,s);
+    f->u.ts.stride = s;
+    f->u.ts.synclocks += 1;
+  }
+  return ((s > 0) && (list_size (f->data) >= s));
+}
+
+/* Provide the TS packet at f->data.out as a contiguous block.
+ * If the packet does not cross the wrapping point of the raw input buffer,
+ * it is referenced in place, otherwise it is copied to tswrap.
+ * Precondition: f!=NULL, list_size(f->data)>=TS_PACKET_SIZE
+ * Return: pointer to the packet.
+ */
+static byte *ts_packet_contiguous (file_descr *f)
+{
+  int i;
+  i = f->data.mask + 1 - f->data.out;
+  if (i >= TS_PACKET_SIZE) {
+    return (&f->data.ptr[f->data.out]);
+  }
+  warn (LDEB,"Packet wraps",ETST,2,2,i);
+  memcpy (&tswrap[0],&f->data.ptr[f->data.out],i);
+  memcpy (&tswrap[i],&f->data.ptr[0],TS_PACKET_SIZE-i);
+  return (&tswrap[0]);
 }
 
 /* Determine the PID of a TS packet and other details.
- * Procondition: d!=NULL points to a packet.
+ * Procondition: d!=NULL points to a contiguous packet.
  * Postcondition: Set global "Payload Unit Start Indicator", "Adaption Field
  * Control & Continuity Counter", "Adataption Field Flags 1".
  * Return: 13 bit PID.
  */
-static int ts_packet_headinfo (refr_data *d)
+static int ts_packet_headinfo (byte *d)
 {
-  int i, l;
-  i = d->out;
-  list_incr (i,*d,TS_PACKET_PID);
-  l = (pusi = d->ptr[i]) & 0x1F;
-  list_incr (i,*d,1);
-  l = (l << 8) | d->ptr[i];
-  list_incr (i,*d,1);
-  if (!((afcc = d->ptr[i]) & TS_AFC_BOTH)) {
+  int l;
+  l = (pusi = d[TS_PACKET_PID]) & 0x1F;
+  l = (l << 8) | d[TS_PACKET_PID+1];
+  if (!((afcc = d[TS_PACKET_CONTICNT]) & TS_AFC_BOTH)) {
     l = TS_PID_NULL;
   } else {
     if (afcc & TS_AFC_ADAPT) {
       byte aflen;
-      list_incr (i,*d,1);
-      if ((aflen = d->ptr[i]) == 0) {
+      if ((aflen = d[TS_PACKET_ADAPTLEN]) == 0) {
         afflg1 = 0x00;
       } else {
-        list_incr (i,*d,1);
-        afflg1 = d->ptr[i];
+        afflg1 = d[TS_PACKET_FLAGS1];
       }
       paylen = TS_PACKET_SIZE - TS_PACKET_FLAGS1 - aflen;
+      if (paylen < 0) {
+        warn (LWAR,"Adaption field length",ETST,2,3,aflen);
+        afflg1 = 0x00;
+        paylen = 0;
+      }
     } else {
       paylen = TS_PACKET_SIZE - TS_PACKET_HEADSIZE;
     }
@@ -107,17 +276,17 @@ static int ts_packet_headinfo (refr_data *d)
 
 /* Extract adaption field from a TS packet.
  * Distribute the information as needed (to s, s->ctrl, etc).
- * Precondition: f!=NULL, adf indicates a packet in f->data, s!=NULL is the
+ * Precondition: tspacket points to the current packet, s!=NULL is the
  * destined data stream, m!=NULL the map stream, afcc and afflg1 set.
  */
 static void ts_adaption_field (file_descr *f,
-    int adf,
     stream_descr *s,
     stream_descr *m)
 {
-  warn (LDEB,"AdaptF",ETST,11,adf,afcc);
+  byte *adf;
+  warn (LDEB,"AdaptF",ETST,11,f->data.out,afcc);
   if (afcc & TS_AFC_ADAPT) {
-    list_incr (adf,f->data,TS_PACKET_FLAGS1+1);
+    adf = &tspacket[TS_PACKET_FLAGS1+1];
     if (afflg1 & TS_ADAPT_DISCONTI) {
     }
     if (afflg1 & TS_ADAPT_RANDOMAC) {
@@ -129,79 +298,103 @@ static void ts_adaption_field (file_descr *f,
       long b;
       byte a;
       pcr = &s->ctrl.ptr[s->ctrl.in].pcr;
-      a = f->data.ptr[adf];
-      list_incr (adf,f->data,1);
+      a = *adf++;
       pcr->ba33 = (a >> 7) & 1;
-      b = (a << 8) | f->data.ptr[adf];
-      list_incr (adf,f->data,1);
-      b = (b << 8) | f->data.ptr[adf];
-      list_incr (adf,f->data,1);
-      b = (b << 8) | f->data.ptr[adf];
-      list_incr (adf,f->data,1);
-      a = f->data.ptr[adf];
+      b = (a << 8) | *adf++;
+      b = (b << 8) | *adf++;
+      b = (b << 8) | *adf++;
+      a = *adf++;
       pcr->base = (b << 1) | ((a >> 7) & 1);
       marker_check (a,0x7E,0x7E);
-      list_incr (adf,f->data,1);
-      pcr->ext = ((a & 1) << 8) | f->data.ptr[adf];
+      pcr->ext = ((a & 1) << 8) | *adf++;
       warn (LINF,"PCR",ETST,10,pcr->ba33,pcr->base);
       pcr->valid = TRUE;
-      list_incr (adf,f->data,1);
 /* attention ! what if it is not PCR_PID ? xxx */
       if (S_ISREG (f->st_mode)) {
-        cref2msec (&m->u.m.conv, *pcr, &m->u.m.msectime); 
+        cref2clock (&m->u.m.conv, *pcr, &m->u.m.clocktime); 
       } else {
-        cref2msec (&m->u.m.conv, *pcr, &m->u.m.msectime); 
+        cref2clock (&m->u.m.conv, *pcr, &m->u.m.clocktime); 
       }
+      m->u.m.pcrarrival = (f->u.ts.stride == TS_STRIDE_M2TS)
+                        ? f->u.ts.arrival : -1;
     }
     if (afflg1 & TS_ADAPT_OPCRFLAG) {
       clockref *opcr;
       long b;
       byte a;
       opcr = &s->ctrl.ptr[s->ctrl.in].opcr;
-      a = f->data.ptr[adf];
-      list_incr (adf,f->data,1);
+      a = *adf++;
       opcr->ba33 = (a >> 7) & 1;
-      b = (a << 8) | f->data.ptr[adf];
-      list_incr (adf,f->data,1);
-      b = (b << 8) | f->data.ptr[adf];
-      list_incr (adf,f->data,1);
-      b = (b << 8) | f->data.ptr[adf];
-      list_incr (adf,f->data,1);
-      a = f->data.ptr[adf];
+      b = (a << 8) | *adf++;
+      b = (b << 8) | *adf++;
+      b = (b << 8) | *adf++;
+      a = *adf++;
       opcr->base = (b << 1) | ((a >> 7) & 1);
       marker_check (a,0x7E,0x7E);
-      list_incr (adf,f->data,1);
-      opcr->ext = ((a & 1) << 8) | f->data.ptr[adf];
+      opcr->ext = ((a & 1) << 8) | *adf++;
       warn (LINF,"OPCR",ETST,10,opcr->ba33,opcr->base);
       opcr->valid = TRUE;
       s->u.d.has_opcr = TRUE;
-      list_incr (adf,f->data,1);
-    }
-    if (afflg1 & TS_ADAPT_SPLICING) {
-      list_incr (adf,f->data,1);
     }
-    if (afflg1 & TS_ADAPT_TPRIVATE) {
-      byte tpdl;
-      tpdl = f->data.ptr[adf];
-      list_incr (adf,f->data,tpdl+1);
-    }
-    if (afflg1 & TS_ADAPT_EXTENSIO) {
-      byte afflg2, afel;
-      afel = f->data.ptr[adf];
-      list_incr (adf,f->data,1);
-      afflg2 = f->data.ptr[adf];
-      list_incr (adf,f->data,1);
-      if (afflg2 & TS_ADAPT2_LTWFLAG) {
-        list_incr (adf,f->data,2);
-      }
-      if (afflg2 & TS_ADAPT2_PIECEWRF) {
-        list_incr (adf,f->data,3);
-      }
-      if (afflg2 & TS_ADAPT2_SEAMLESS) {
-        list_incr (adf,f->data,5);
-      }
+  }
+}
+
+/* Determine the push time of data from the actual packet.
+ * This is the time of the last PCR of the map stream, for M2TS input
+ * advanced by the arrival time that passed since that PCR, as far as
+ * it is plausible.
+ * Precondition: f!=NULL, m!=NULL the map stream
+ * Return: push time
+ */
+static t_clock ts_clockpush (file_descr *f,
+    stream_descr *m)
+{
+  t_clock t;
+  if ((f->u.ts.stride == TS_STRIDE_M2TS)
+   && (m->u.m.pcrarrival >= 0)) {
+    t = f->u.ts.arrival - m->u.m.pcrarrival;
+    if ((t >= 0)
+     && (t < msec2clock (MAX_MSEC_PUSHJTTR))) {
+      return (m->u.m.clocktime + t);
     }
   }
+  return (m->u.m.clocktime);
+}
+
+/* Keep one TS packet of a stream in passthrough mode as it is.
+ * The adaption field is evaluated for timing only.
+ * Precondition: f!=NULL, s!=NULL, s->u.d.pass!=PASS_NONE,
+ *               !list_full(s->ctrl)
+ * Return: TRUE if something was processed, FALSE if no space available
+ */
+static boolean ts_pass_packet (file_descr *f,
+    stream_descr *s)
+{
+  ctrl_buffer *c;
+  if (list_free (s->data) < (2*TS_PACKET_SIZE-1)) {
+    return (FALSE);
+  }
+  if (TS_PACKET_SIZE > list_freeinend (s->data)) {
+    s->data.in = 0;
+  }
+  c = &s->ctrl.ptr[s->ctrl.in];
+  c->index = s->data.in;
+  c->length = TS_PACKET_SIZE;
+  c->pcr.valid = FALSE;
+  c->opcr.valid = FALSE;
+  ts_adaption_field (f,s,s->u.d.mapstream);
+  memcpy (&s->data.ptr[s->data.in],tspacket,TS_PACKET_SIZE);
+  list_incr (s->data.in,s->data,TS_PACKET_SIZE);
+  list_incr (f->data.out,f->data,TS_PACKET_SIZE);
+  f->payload += TS_PACKET_SIZE;
+  f->total += TS_PACKET_SIZE;
+  input_splitdone (s,TS_PACKET_SIZE);
+  c->sequence = f->sequence++;
+  c->scramble = 0;
+  c->clockread = input_clockread (f);
+  c->clockpush = ts_clockpush (f,s->u.d.mapstream);
+  list_incr (s->ctrl.in,s->ctrl,1);
+  return (TRUE);
 }
 
 /* Parse one TS packet with given PID.
@@ -222,21 +415,25 @@ static boolean ts_data_stream (file_descr *f,
 {
   stream_descr *s;
   ctrl_buffer *c;
-  int i, fdo, sdi, adf;
+  int i, fdo, sdi;
   warn (LDEB,"Data Packet",ETST,3,0,pid);
   s = ts_file_stream (f,pid);
   if (s != NULL) {
     if (!list_full (s->ctrl)) {
+      if (s->u.d.pass != PASS_NONE) {
+        return (ts_pass_packet (f,s));
+      }
       c = &s->ctrl.ptr[s->ctrl.in];
       if (c->length == -1) {
         if (pusi & TS_UNIT_START) {
           c->length = s->data.in - c->index;
           warn (LINF,"Closed unbound packet",ETST,3,5,c->length);
           f->payload += c->length;
+          input_splitdone (s,c->length);
           c->sequence = f->sequence++;
           c->scramble = 0;
-          c->msecread = msec_now ();
-          c->msecpush = s->u.d.mapstream->u.m.msectime;
+          c->clockread = input_clockread (f);
+          c->clockpush = ts_clockpush (f,s->u.d.mapstream);
           list_incr (s->ctrl.in,s->ctrl,1);
           c = &s->ctrl.ptr[s->ctrl.in];
           c->length = 0;
@@ -265,8 +462,7 @@ static boolean ts_data_stream (file_descr *f,
         }
       }
       sdi = s->data.in;
-      fdo = adf = f->data.out;
-      list_incr (fdo,f->data,TS_PACKET_SIZE - paylen);
+      fdo = TS_PACKET_SIZE - paylen;
       if (c->length == -1) {
         if (list_freecachedin (s->data,sdi) >= paylen) {
           i = list_freeinendcachedin (s->data,sdi);
@@ -280,32 +476,20 @@ static boolean ts_data_stream (file_descr *f,
               return (FALSE);
             }
           }
-          while (paylen > 0) {
-            i = MAX_DATA_RAWB - fdo;
-            if (i > paylen) {
-              i = paylen;
-            }
-            memcpy (&s->data.ptr[sdi],&f->data.ptr[fdo],i);
-            list_incr (sdi,s->data,i);
-            list_incr (fdo,f->data,i);
-            paylen -= i;
-          }
+          memcpy (&s->data.ptr[sdi],&tspacket[fdo],paylen);
+          list_incr (sdi,s->data,paylen);
+          fdo += paylen;
+          paylen = 0;
         } else {
           return (FALSE);
         }
       }
       if (c->length < -2) {
         c->length += paylen;
-        while (paylen > 0) {
-          i = MAX_DATA_RAWB - fdo;
-          if (i > paylen) {
-            i = paylen;
-          }
-          memcpy (&s->data.ptr[sdi],&f->data.ptr[fdo],i);
-          list_incr (sdi,s->data,i);
-          list_incr (fdo,f->data,i);
-          paylen -= i;
-        }
+        memcpy (&s->data.ptr[sdi],&tspacket[fdo],paylen);
+        list_incr (sdi,s->data,paylen);
+        fdo += paylen;
+        paylen = 0;
         if (c->length > -2) {
           c->length = -2;
         }
@@ -316,6 +500,9 @@ static boolean ts_data_stream (file_descr *f,
          || (s->data.ptr[c->index+2] != 0x01)) {
           warn (LWAR,"Payload not good PES",ETST,3,3,0);
           c->length = 0;
+          f->skipped += TS_PACKET_SIZE;
+          list_incr (f->data.out,f->data,TS_PACKET_SIZE);
+          f->total += TS_PACKET_SIZE;
           return (TRUE);
         }
         i = (s->data.ptr[c->index+PES_PACKET_LENGTH] << 8)
@@ -327,6 +514,7 @@ static boolean ts_data_stream (file_descr *f,
           if (i > list_freeinendcachedin (s->data,c->index) - PES_HEADER_SIZE) {
             if (list_freecachedin (s->data,sdi) <
                   (2 * (i + PES_HEADER_SIZE) - (sdi - c->index) - 1)) {
+              input_splitwanted (s,i + PES_HEADER_SIZE);
               return (FALSE);
             } else {
               sdi -= c->index;
@@ -336,6 +524,7 @@ static boolean ts_data_stream (file_descr *f,
           } else {
             if (list_freecachedin (s->data,sdi) <
                   (i + PES_HEADER_SIZE - (sdi - c->index))) {
+              input_splitwanted (s,i + PES_HEADER_SIZE);
               return (FALSE);
             }
           }
@@ -353,27 +542,22 @@ static boolean ts_data_stream (file_descr *f,
           paylen = c->length;
         }
         c->length -= paylen;
-        while (paylen > 0) {
-          i = MAX_DATA_RAWB - fdo;
-          if (i > paylen) {
-            i = paylen;
-          }
-          memcpy (&s->data.ptr[sdi],&f->data.ptr[fdo],i);
-          list_incr (sdi,s->data,i);
-          list_incr (fdo,f->data,i);
-          paylen -= i;
-        }
+        memcpy (&s->data.ptr[sdi],&tspacket[fdo],paylen);
+        list_incr (sdi,s->data,paylen);
+        fdo += paylen;
+        paylen = 0;
       }
       s->data.in = sdi;
-      f->data.out = fdo;
-      ts_adaption_field (f,adf,s,s->u.d.mapstream);
+      list_incr (f->data.out,f->data,fdo);
+      ts_adaption_field (f,s,s->u.d.mapstream);
       if (c->length == 0) {
         c->length = s->data.in - c->index;
         f->payload += c->length;
+        input_splitdone (s,c->length);
         c->sequence = f->sequence++;
         c->scramble = 0;
-        c->msecread = msec_now ();
-        c->msecpush = s->u.d.mapstream->u.m.msectime;
+        c->clockread = input_clockread (f);
+        c->clockpush = ts_clockpush (f,s->u.d.mapstream);
         list_incr (s->ctrl.in,s->ctrl,1);
         c = &s->ctrl.ptr[s->ctrl.in];
         c->length = 0;
@@ -659,6 +843,7 @@ static void eval_pat_section (file_descr *f,
           p = p->next;
         }
         release_old_progs (f,&f->u.ts.pat);
+        ts_file_pidchanged (f);
       }
     }
   } else {
@@ -739,6 +924,7 @@ static void eval_pmt_section (file_descr *f,
       } else {
         remap_new_program (f,p);
         release_old_progs (f,&f->u.ts.pat);
+        ts_file_pidchanged (f);
       }
     }
   } else {
@@ -758,16 +944,16 @@ static boolean ts_psi_table_section (file_descr *f,
     int tableid)
 {
   stream_descr *s;
-  int i, b, adf;
+  int i, b, o;
   int seclen;
   boolean complete;
   warn (LDEB,"PSI",ETST,4,pid,tableid);
-  adf = f->data.out;
-  list_incr (f->data.out,f->data,TS_PACKET_SIZE - paylen);
+  o = TS_PACKET_SIZE - paylen;
+  list_incr (f->data.out,f->data,o);
   s = ts_file_stream (f,pid);
   if (pusi & TS_UNIT_START) {
-    i = f->data.ptr[f->data.out];
-    if (i >= paylen) {
+    if ((paylen <= 0)
+     || ((i = tspacket[o]) >= paylen)) {
       warn (LWAR,"PSI pointer exceed",ETST,4,1,b);
       s->u.m.psi_length = 0;
       list_incr (f->data.out,f->data,paylen);
@@ -792,6 +978,7 @@ static boolean ts_psi_table_section (file_descr *f,
     }
   }
   list_incr (f->data.out,f->data,b);
+  o += b;
   b = paylen - b;
   if (s->u.m.psi_length + b > sizeof(s->u.m.psi_data)) {
     warn (LWAR,"PSI overflow",ETST,4,2,s->u.m.psi_length + b);
@@ -799,18 +986,10 @@ static boolean ts_psi_table_section (file_descr *f,
     list_incr (f->data.out,f->data,b);
     return (TRUE);
   }
-  ts_adaption_field (f,adf,s,s);
-  while (b > 0) {
-    i = MAX_DATA_RAWB - f->data.out;
-    if (i > b) {
-      i = b;
-    }
-    memcpy (&s->u.m.psi_data[s->u.m.psi_length],
-            &f->data.ptr[f->data.out],i);
-    list_incr (f->data.out,f->data,i);
-    s->u.m.psi_length += i;
-    b -= i;
-  }
+  ts_adaption_field (f,s,s);
+  memcpy (&s->u.m.psi_data[s->u.m.psi_length],&tspacket[o],b);
+  list_incr (f->data.out,f->data,b);
+  s->u.m.psi_length += b;
   if (complete) {
     if (s->u.m.psi_length >= TS_HEADSLEN) {
       i = ((s->u.m.psi_data[TS_SECTIONLEN] & 0x0F) << 8)
@@ -985,6 +1164,8 @@ static boolean split_autostreammatch (file_descr *f,
 
 /* For a packet that does not belong to an active stream, check whether
  * to open a stream for it automatically.
+ * The stream is kept in passthrough mode, if so requested by the first
+ * matching request.
  * Precondition: f!=NULL.
  * Return: TRUE, if a stream was opened now, FALSE otherwise.
  */
@@ -993,23 +1174,22 @@ static boolean split_autostream (file_descr *f,
 {
   pmt_descr *pmt;
   boolean r;
+  byte pass;
   tsauto_descr *a;
   tsauto_descr **aa;
   warn (LDEB,"Auto Stream",ETST,9,0,pid);
   r = FALSE;
+  pass = PASS_NONE;
   if (pusi & TS_UNIT_START) {
     if ((f->automatic)
      || (f->u.ts.tsauto != NULL)) {
       if (paylen >= PES_HDCODE_SIZE) {
-        int x;
-        x = f->data.out;
-        list_incr (x,f->data,TS_PACKET_SIZE - paylen);
-        if (f->data.ptr[x] == 0x00) {
-          list_incr (x,f->data,1);
-          if (f->data.ptr[x] == 0x00) {
-            list_incr (x,f->data,1);
-            if (f->data.ptr[x] == 0x01) {
-              list_incr (x,f->data,1);
+        byte *x;
+        x = &tspacket[TS_PACKET_SIZE - paylen];
+        if (x[0] == 0x00) {
+          if (x[1] == 0x00) {
+            if (x[2] == 0x01) {
+              x += 3;
               pmt = f->u.ts.pat;
               while (pmt != NULL) {
                 if (pmt->pmt_pid == pid) {
@@ -1019,14 +1199,18 @@ static boolean split_autostream (file_descr *f,
                 pmt = pmt->next;
               }
               if (f->automatic) {
-                split_autostreammatch (f,pid,f->data.ptr[x],NULL);
+                split_autostreammatch (f,pid,*x,NULL);
+                pass = f->u.ts.autopass;
                 r = TRUE;
               }
               aa = &f->u.ts.tsauto;
               a = *aa;
               while (a != NULL) {
-                if (split_autostreammatch (f,pid,f->data.ptr[x],a)) {
+                if (split_autostreammatch (f,pid,*x,a)) {
                   r = TRUE;
+                  if (pass == PASS_NONE) {
+                    pass = a->pass;
+                  }
                   if (a->ssid >= 0) {
                     *aa = a->next; /* delete single entries when matched */
                     free (a);
@@ -1044,6 +1228,9 @@ static boolean split_autostream (file_descr *f,
       }
     }
   }
+  if (ts_file_stream (f,pid) != NULL) {
+    ts_file_stream (f,pid)->u.d.pass = pass;
+  }
   return (r);
 }
 
@@ -1088,23 +1275,15 @@ static boolean ts_unparsed_si (file_descr *f)
           s->data.in = 0;
         }
         c->index = s->data.in;
-        c->length = 0;
-        while (c->length < TS_PACKET_SIZE) {
-          int i;
-          i = MAX_DATA_RAWB - f->data.out;
-          if (i > (TS_PACKET_SIZE - c->length)) {
-            i = TS_PACKET_SIZE - c->length;
-          }
-          memcpy (&s->data.ptr[s->data.in],&f->data.ptr[f->data.out],i);
-          list_incr (s->data.in,s->data,i);
-          list_incr (f->data.out,f->data,i);
-          c->length += i;
-        }
+        c->length = TS_PACKET_SIZE;
+        memcpy (&s->data.ptr[s->data.in],tspacket,TS_PACKET_SIZE);
+        list_incr (s->data.in,s->data,TS_PACKET_SIZE);
+        list_incr (f->data.out,f->data,TS_PACKET_SIZE);
         f->payload += TS_PACKET_SIZE;
         c->sequence = f->sequence++;
         c->scramble = 0;
-        c->msecread = msec_now ();
-/* c->msecpush not set, because there is no scr/pcr or similar available */
+        c->clockread = input_clockread (f);
+/* c->clockpush not set, because there is no scr/pcr or similar available */
 /*
         c->pcr.valid = FALSE;
         c->opcr.valid = FALSE;
@@ -1133,7 +1312,7 @@ void split_checkpcrpid (file_descr *f,
   pmt = f->u.ts.pat;
   while (pmt != NULL) {
     if (pmt->pcr_pid == pid) {
-      ts_adaption_field (f,f->data.out,
+      ts_adaption_field (f,
           ts_file_stream (f,pmt->pmt_pid),ts_file_stream (f,pmt->pmt_pid));
       return;
 /* only needed, if any of the streams is in use, but then the pcr
@@ -1144,61 +1323,392 @@ void split_checkpcrpid (file_descr *f,
   }
 }
 
+/* Rebuild the PID classification table of a TS file.
+ * Precedence is the same as for the former per packet checks: open
+ * streams first, then unparsed SI ranges, then streams of source programs
+ * that may be opened automatically, then PCR of source programs.
+ * Note whether a stream request with unknown source program (sprg=0) may
+ * open any other PID, too.
+ * Precondition: f!=NULL
+ */
+static void split_classifypids (file_descr *f)
+{
+  int i, h;
+  byte *c;
+  pmt_descr *pmt;
+  tsauto_descr *a;
+  tssi_descr *tssi;
+  stream_descr *s;
+  warn (LDEB,"Classify PIDs",ETST,14,0,f);
+  c = &f->u.ts.pidclass[0];
+  memset (&c[0],pc_resync,TS_PID_LOWEST);
+  memset (&c[TS_PID_LOWEST],pc_drop,TS_PID_HIGHEST-TS_PID_LOWEST+1);
+  pmt = f->u.ts.pat;
+  while (pmt != NULL) {
+    if ((pmt->pcr_pid >= TS_PID_LOWEST)
+     && (pmt->pcr_pid <= TS_PID_HIGHEST)) {
+      c[pmt->pcr_pid] = pc_pcronly;
+    }
+    pmt = pmt->next;
+  }
+  f->u.ts.autounlisted = FALSE;
+  a = f->u.ts.tsauto;
+  while (a != NULL) {
+    if (a->sprg == 0) {
+      f->u.ts.autounlisted = TRUE;
+    }
+    a = a->next;
+  }
+  pmt = f->u.ts.pat;
+  while (pmt != NULL) {
+    a = f->u.ts.tsauto;
+    while ((a != NULL)
+        && (a->sprg != pmt->programnumber)) {
+      a = a->next;
+    }
+    if ((f->automatic)
+     || (a != NULL)) {
+      i = pmt->streams;
+      while (--i >= 0) {
+        c[pmt->stream[i]] = pc_auto;
+      }
+    }
+    pmt = pmt->next;
+  }
+  tssi = f->u.ts.tssi;
+  while (tssi != NULL) {
+    i = tssi->pid_low;
+    h = tssi->pid_high;
+    if (h > TS_PID_HIGHEST) {
+      h = TS_PID_HIGHEST;
+    }
+    while (i <= h) {
+      c[i++] = pc_unparsedsi;
+    }
+    tssi = tssi->next;
+  }
+  i = TS_PID_HIGHEST + 1;
+  while (--i >= TS_PID_LOWEST) {
+    if ((s = ts_file_stream (f,i)) != NULL) {
+      c[i] = (s->streamdata == sd_data) ? pc_data : pc_psi;
+    }
+  }
+  c[TS_PID_PAT] = pc_pat;
+  c[TS_PID_NULL] = pc_drop;
+  f->u.ts.pidclass_valid = TRUE;
+}
+
+/* Move raw data within the raw data buffer of a file, towards its start.
+ * Precondition: f!=NULL, w is not behind q in the buffer
+ */
+static void split_rawmove (file_descr *f,
+    int w,
+    int q,
+    int n)
+{
+  int i;
+  if ((w + n <= f->data.mask + 1)
+   && (q + n <= f->data.mask + 1)) {
+    memmove (&f->data.ptr[w],&f->data.ptr[q],n);
+  } else {
+    i = 0;
+    while (i < n) {
+      f->data.ptr[(w + i) & f->data.mask] = f->data.ptr[(q + i) & f->data.mask];
+      i += 1;
+    }
+  }
+}
+
+/* Check whether the PAT or PMT packet at q in the raw data may change the
+ * PID classification, i.e. whether it starts a section, that is not
+ * known yet to the splitter, or continues a section, that the splitter
+ * has begun but not completed yet. Sections that are not current do not.
+ * Precondition: f!=NULL, list_size from q >= TS_PACKET_SIZE,
+ * ts_file_stream(f,pid)!=NULL
+ * Return: TRUE if the filter must not pass the packet, FALSE otherwise
+ */
+static boolean split_tsbarrier (file_descr *f,
+    int q,
+    int pid)
+{
+  int o, v, prognb;
+  byte *d;
+  pmt_descr *pmt;
+  d = f->data.ptr;
+#define rawbyte(i) d[(q + (i)) & f->data.mask]
+  if (!(rawbyte (TS_PACKET_CONTICNT) & TS_AFC_PAYLD)) {
+    return (FALSE);
+  }
+  if (!(rawbyte (TS_PACKET_PID) & TS_UNIT_START)) {
+    return (ts_file_stream (f,pid)->u.m.psi_length != 0);
+  }
+  o = TS_PACKET_HEADSIZE;
+  if (rawbyte (TS_PACKET_CONTICNT) & TS_AFC_ADAPT) {
+    o += rawbyte (TS_PACKET_ADAPTLEN) + 1;
+  }
+  if (o >= TS_PACKET_SIZE) {
+    return (FALSE);
+  }
+  o += rawbyte (o) + 1;
+  if (o + TS_SECTIONHEAD > TS_PACKET_SIZE) {
+    return (TRUE);
+  }
+  v = rawbyte (o + TS_VERSIONNB);
+  if (!(v & 0x01)) {
+    return (FALSE);
+  }
+  v = (v >> 1) & 0x1F;
+  if (pid == TS_PID_PAT) {
+    return ((rawbyte (o + TS_TABLE_ID) != TS_TABLEID_PAT)
+         || (v != f->u.ts.newpat_version)
+         || (rawbyte (o + TS_LASTSECNB) != 0));
+  }
+  if (rawbyte (o + TS_TABLE_ID) != TS_TABLEID_PMT) {
+    return (FALSE);
+  }
+  prognb = (rawbyte (o + TS_TRANSPORTID) << 8)
+         | rawbyte (o + TS_TRANSPORTID + 1);
+#undef rawbyte
+  pmt = f->u.ts.pat;
+  while ((pmt != NULL)
+      && ((pmt->programnumber != prognb)
+       || (pmt->pmt_pid != pid))) {
+    pmt = pmt->next;
+  }
+  return ((pmt == NULL) || (pmt->pmt_version != v));
+}
+
+/* Discard TS packets of PIDs that are not used, from the raw data that
+ * has just been read, before the splitter has to look at it.
+ * Packets that carry the PCR of a source program without being used
+ * otherwise are kept only if they actually contain a PCR.
+ * The filter starts as soon as the splitter has found sync, and stops
+ * if sync is lost, until the splitter has found it again. Packets with
+ * a time stamp or parity are not filtered.
+ * Nothing is discarded until the PAT and all PMTs are known, nor while
+ * a stream may still be opened automatically without being listed in
+ * a PMT. A PAT or PMT section, that the splitter does not know yet, is a
+ * barrier: the filter stops in front of it, and in front of each packet
+ * continuing it, until the splitter has completed the section, so that
+ * it resumes with the classification renewed if needed.
+ * Precondition: f!=NULL, f->content==ct_transport, data is not mapped
+ */
+void split_tsfilter (file_descr *f)
+{
+  int q, w, pid;
+  byte *d;
+  boolean sync;
+  pmt_descr *pmt;
+  tsauto_descr *a;
+  if (f->u.ts.stride != TS_PACKET_SIZE) {
+    return;
+  }
+  a = f->u.ts.tsauto;
+  while (a != NULL) {
+    if (a->sprg == 0) {
+      return;
+    }
+    a = a->next;
+  }
+  pmt = f->u.ts.pat;
+  if (pmt == NULL) {
+    return;
+  }
+  while (pmt != NULL) {
+    if (pmt->pmt_version == 0xFF) {
+      return;
+    }
+    pmt = pmt->next;
+  }
+  if (!f->u.ts.pidclass_valid) {
+    split_classifypids (f);
+  }
+  d = f->data.ptr;
+  q = f->u.ts.filterpos;
+  if ((q < 0)
+   || (((q - f->data.out) & f->data.mask) > list_size (f->data))) {
+    q = f->data.out;
+    if ((list_empty (f->data))
+     || (d[q] != TS_SYNC_BYTE)) {
+      f->u.ts.filterpos = -1;
+      return;
+    }
+  }
+  w = q;
+  sync = TRUE;
+  while (((f->data.in - q) & f->data.mask) >= TS_PACKET_SIZE) {
+    if (d[q] != TS_SYNC_BYTE) {
+      warn (LDEB,"Filter sync",ETST,15,q,w);
+      sync = FALSE;
+      break;
+    }
+    pid = ((d[(q + 1) & f->data.mask] & 0x1F) << 8)
+        | d[(q + 2) & f->data.mask];
+    if (((f->u.ts.pidclass[pid] == pc_pat)
+      || (f->u.ts.pidclass[pid] == pc_psi))
+     && split_tsbarrier (f,q,pid)) {
+      warn (LDEB,"Filter barrier",ETST,15,q,pid);
+      break;
+    }
+    if ((f->u.ts.pidclass[pid] == pc_drop)
+     || ((f->u.ts.pidclass[pid] == pc_pcronly)
+      && ((!(d[(q + TS_PACKET_CONTICNT) & f->data.mask] & TS_AFC_ADAPT))
+       || (d[(q + TS_PACKET_ADAPTLEN) & f->data.mask] == 0)
+       || (!(d[(q + TS_PACKET_FLAGS1) & f->data.mask]
+             & TS_ADAPT_PCRFLAG))))) {
+      f->total += TS_PACKET_SIZE;
+    } else {
+      if (w != q) {
+        split_rawmove (f,w,q,TS_PACKET_SIZE);
+      }
+      list_incr (w,f->data,TS_PACKET_SIZE);
+    }
+    list_incr (q,f->data,TS_PACKET_SIZE);
+  }
+  f->u.ts.filterpos = sync ? w : -1;
+  if (w != q) {
+    split_rawmove (f,w,q,(f->data.in - q) & f->data.mask);
+    f->data.in = (w + ((f->data.in - q) & f->data.mask)) & f->data.mask;
+  }
+}
+
+/* Split one TS packet.
+ * The PID is dispatched via the classification table, that is rebuilt
+ * whenever it was marked invalid (possibly by the previous packet).
+ * Precondition: f!=NULL, f->data.out indicates a syncbyte,
+ * list_size(f->data)>=TS_PACKET_SIZE.
+ * Return: TRUE, if something was processed, FALSE if no space available
+ */
+static boolean split_ts_packet (file_descr *f)
+{
+  int pid;
+  tspacket = ts_packet_contiguous (f);
+  pid = ts_packet_headinfo (tspacket);
+  if (!f->u.ts.pidclass_valid) {
+    split_classifypids (f);
+  }
+  if (dataonly
+   && (f->u.ts.pidclass[pid] != pc_data)
+   && (f->u.ts.pidclass[pid] != pc_resync)) {
+    return (FALSE);
+  }
+  switch ((pid_class)f->u.ts.pidclass[pid]) {
+    case pc_data:
+      return (ts_data_stream (f,pid));
+    case pc_psi:
+      return (ts_psi_table_section (f,pid,TS_TABLEID_PMT));
+    case pc_pat:
+      return (ts_psi_table_section (f,TS_PID_PAT,TS_TABLEID_PAT));
+    case pc_resync:
+      f->skipped += TS_PACKET_SIZE;
+      f->total += TS_PACKET_SIZE;
+      list_incr (f->data.out,f->data,TS_PACKET_SIZE);
+      return (TRUE);
+    default:
+      break;
+  }
+  if ((pid >= TS_PID_LOWEST)
+   && (pid <= TS_PID_HIGHEST)
+   && ((f->u.ts.pidclass[pid] == pc_auto)
+    || (f->u.ts.autounlisted))
+   && split_autostream (f,pid)) {
+    return (ts_data_stream (f,pid));
+  }
+  switch ((pid_class)f->u.ts.pidclass[pid]) {
+    case pc_unparsedsi:
+      warn (LDEB,"Unparsed SI",ETST,0,2,pid);
+      return (ts_unparsed_si (f));
+    case pc_pcronly:
+    case pc_auto:
+      split_checkpcrpid (f,pid);
+      break;
+    default:
+      break;
+  }
+  warn (LDEB,"Data Packet (ignored)",ETST,0,1,pid);
+  f->total += TS_PACKET_SIZE;
+  list_incr (f->data.out,f->data,TS_PACKET_SIZE);
+  return (TRUE);
+}
+
+/* Take the arrival time stamp of the M2TS packet at f->data.out.
+ * The 30 bit 27MHz stamps are accumulated to a time without wrapping.
+ * Precondition: f!=NULL, f->u.ts.stride==TS_STRIDE_M2TS,
+ * list_size(f->data)>=TS_STRIDE_M2TS
+ */
+static void ts_arrival (file_descr *f)
+{
+  uint32_t a;
+  int i;
+  a = 0;
+  i = 0;
+  while (i < TS_STRIDE_M2TS - TS_PACKET_SIZE) {
+    a = (a << 8) | f->data.ptr[(f->data.out + i) & f->data.mask];
+    i += 1;
+  }
+  a &= TS_ARRIVAL_MASK;
+  if (f->u.ts.arrivalvalid) {
+    f->u.ts.arrival += (a - f->u.ts.arrivalstamp) & TS_ARRIVAL_MASK;
+  } else {
+    f->u.ts.arrival = a;
+    f->u.ts.arrivalvalid = TRUE;
+  }
+  f->u.ts.arrivalstamp = a;
+}
+
+/* Split one TS packet at the stride that is in sync, i.e. skip the time
+ * stamp ahead of it or the parity behind it, too.
+ * Precondition: f!=NULL, f->u.ts.stride>0, f->data.out indicates the
+ * start of a packet, list_size(f->data)>=f->u.ts.stride.
+ * Return: TRUE, if something was processed, FALSE if no space available
+ */
+static boolean split_ts_stride (file_descr *f)
+{
+  int u;
+  u = f->data.out;
+  if (f->u.ts.stride == TS_STRIDE_M2TS) {
+    ts_arrival (f);
+  }
+  list_incr (f->data.out,f->data,ts_stride_head (f->u.ts.stride));
+  if (!split_ts_packet (f)) {
+    f->data.out = u;
+    return (FALSE);
+  }
+  f->total += f->u.ts.stride - TS_PACKET_SIZE;
+  f->data.out = (u + f->u.ts.stride) & f->data.mask;
+  return (TRUE);
+}
+
 /* Split data from a TS stream.
+ * Once in sync, all complete packets in the raw input buffer are split in
+ * one go, instead of returning to the dispatcher after each packet.
  * Precondition: f!=NULL
  * Return: TRUE, if something was processed, FALSE if not enough data available
  */
 boolean split_ts (file_descr *f)
 {
-  int l, pid;
+  boolean r = FALSE;
   warn (LDEB,"Split TS",ETST,0,0,f);
-  if (ts_skip_to_syncbyte (f)) {
-    l = list_size (f->data);
-    if (l >= TS_PACKET_SIZE) {
-      pid = ts_packet_headinfo (&f->data);
-      if ((pid >= TS_PID_LOWEST) && (pid <= TS_PID_HIGHEST)) {
-        if (ts_file_stream (f,pid) != NULL) {
-          if (ts_file_stream (f,pid)->streamdata == sd_data) {
-            return (ts_data_stream (f,pid));
-          } else {
-            return (ts_psi_table_section (f,pid,TS_TABLEID_PMT));
-          }
-        } else {
-          if (split_autostream (f,pid)) {
-            return (ts_data_stream (f,pid));
-          }
-          if (split_unparsedsi (f,pid) >= 0) {
-            warn (LDEB,"Unparsed SI",ETST,0,2,pid);
-            return (ts_unparsed_si (f));
-          }
-          split_checkpcrpid (f,pid);
-          warn (LDEB,"Data Packet (ignored)",ETST,0,1,pid);
-          f->total += TS_PACKET_SIZE;
-          list_incr (f->data.out,f->data,TS_PACKET_SIZE);
-          return (TRUE);
-        }
-      } else if (pid == TS_PID_PAT) {
-        return (ts_psi_table_section (f,TS_PID_PAT,TS_TABLEID_PAT));
-/*
-      } else if (pid == TS_PID_CAT) {
-        return (ts_psi_table_section (f,TS_PID_CAT,TS_TABLEID_CAT));
-*/
-      } else if (pid == TS_PID_NULL) {
-        f->total += TS_PACKET_SIZE;
-        list_incr (f->data.out,f->data,TS_PACKET_SIZE);
-        return (TRUE);
-      } else if (split_unparsedsi (f,pid) >= 0) {
-        warn (LDEB,"Unparsed SI",ETST,0,3,pid);
-        return (ts_unparsed_si (f));
-      } else {
-        /* don't skip 188 here, because it might be an asynchronity */
-        f->skipped += 1;
-        f->total += 1;
-        list_incr (f->data.out,f->data,1);
-        return (TRUE);
-      }
-    }
+  while (ts_skip_to_syncbyte (f)
+      && split_ts_stride (f)) {
+    r = TRUE;
   }
-  return (FALSE);
+  return (r);
 }
 
+/* Split data from a TS stream, as long as the packets belong to open data
+ * streams or are skipped to resync. Stop at any other packet, because
+ * tables, SI and automatic stream detection may alter shared state, and
+ * leave it to split_ts. This may be called for different files at the
+ * same time, while nothing else is running.
+ * Precondition: f!=NULL
+ * Return: TRUE, if something was processed, FALSE otherwise
+ */
+boolean split_ts_parallel (file_descr *f)
+{
+  boolean r;
+  dataonly = TRUE;
+  r = split_ts (f);
+  dataonly = FALSE;
+  return (r);
+}
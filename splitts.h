@@ -21,7 +21,13 @@
 
 #define ts_file_stream(f,sid) (f->u.ts.stream[sid])
 
+/* Request to rebuild the PID classification, after streams, PAT/PMT or
+ * SI ranges of a TS file have changed */
+#define ts_file_pidchanged(f) (f->u.ts.pidclass_valid = FALSE)
+
+void split_tsfilter (file_descr *f);
 boolean split_ts (file_descr *f);
+boolean split_ts_parallel (file_descr *f);
 
 int split_unparsedsi (file_descr *f,
     int pid);
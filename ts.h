@@ -26,6 +26,12 @@
 #define TS_PACKET_FLAGS1   (TS_PACKET_ADAPTLEN+1)
 
 #define TS_SYNC_BYTE  0x47
+#define TS_STRIDE_M2TS 192 /* 4 byte arrival time stamp ahead */
+#define TS_STRIDE_RS   204 /* 16 byte Reed-Solomon parity behind */
+#define TS_LOCK_PACKETS 4  /* sync bytes in a row to confirm sync */
+#define TS_ARRIVAL_MASK 0x3FFFFFFF /* 27MHz M2TS arrival time stamp */
+#define ts_stride_head(s) \
+  (((s) == TS_STRIDE_M2TS) ? (TS_STRIDE_M2TS - TS_PACKET_SIZE) : 0)
 #define TS_UNIT_START (1<<6)
 #define TS_AFC_PAYLD  (1<<4)
 #define TS_AFC_ADAPT  (1<<5)